@@ -0,0 +1,314 @@
+#ifndef ASYNC_LOGGER_H
+#define ASYNC_LOGGER_H
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "windows_sockets.h"
+
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error };
+
+inline const char* logLevelName(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug: return "DEBUG";
+        case LogLevel::Info: return "INFO";
+        case LogLevel::Warn: return "WARN";
+        default: return "ERROR";
+    }
+}
+
+// Asynchronous logger. Each producing thread owns a single-producer ring of
+// fixed-size records, so logging is a bounded memcpy with no lock and no
+// system call; a background thread drains every ring, formats the records
+// and writes them out in batches. When a ring is full the record is
+// dropped and counted rather than blocking the caller.
+//
+// Chat-content records are the bulk of the volume: they can be sampled
+// (one in N) and are shed first, once a ring is half full.
+class AsyncLogger {
+public:
+    static const size_t RECORD_TEXT = 232;
+    static const size_t RING_CAPACITY = 4096;   // records per thread, power of two
+
+private:
+    struct Record {
+        int64_t wallNs;
+        LogLevel level;
+        uint8_t length;
+        char text[RECORD_TEXT];
+    };
+
+    struct Ring {
+        alignas(64) std::atomic<size_t> head;   // next slot to write, producer only
+        alignas(64) std::atomic<size_t> tail;   // next slot to read, consumer only
+        alignas(64) std::atomic<uint64_t> dropped;
+        std::atomic<uint64_t> shed;
+        uint64_t chatSeen;
+        std::unique_ptr<Record[]> records;
+
+        Ring() : head(0), tail(0), dropped(0), shed(0), chatSeen(0), records(new Record[RING_CAPACITY]) {}
+
+        size_t used() const {
+            return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire);
+        }
+    };
+
+    std::mutex ringsMutex;                       // guards registration only
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::vector<Ring*> drainRings;               // writer thread only
+    std::atomic<LogLevel> minLevel;
+    std::atomic<uint32_t> chatSampleEvery;       // 0 = never log chat content
+    std::atomic<bool> running;
+    std::atomic<uint64_t> written;
+    std::thread writer;
+    FILE* output;
+    bool ownsOutput;
+
+    AsyncLogger() : minLevel(LogLevel::Info), chatSampleEvery(1), running(false), written(0),
+                    output(stdout), ownsOutput(false) {}
+
+    Ring& threadRing() {
+        static thread_local Ring* ring = nullptr;
+        if (ring == nullptr) {
+            auto created = std::make_unique<Ring>();
+            ring = created.get();
+            std::lock_guard<std::mutex> lock(ringsMutex);
+            rings.push_back(std::move(created));
+        }
+        return *ring;
+    }
+
+    static void append(Record& record, std::string_view text) {
+        size_t take = std::min(text.size(), RECORD_TEXT - record.length);
+        memcpy(record.text + record.length, text.data(), take);
+        record.length = (uint8_t)(record.length + take);
+    }
+
+    static void append(Record& record, const char* text) {
+        append(record, std::string_view(text));
+    }
+
+    static void append(Record& record, const std::string& text) {
+        append(record, std::string_view(text));
+    }
+
+    static void append(Record& record, char c) {
+        append(record, std::string_view(&c, 1));
+    }
+
+    template <typename T, typename = std::enable_if_t<std::is_integral<T>::value>>
+    static void append(Record& record, T value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        append(record, std::string_view(digits, result.ptr - digits));
+    }
+
+    template <typename... Args>
+    void push(Ring& ring, LogLevel level, const Args&... args) {
+        size_t head = ring.head.load(std::memory_order_relaxed);
+        if (head - ring.tail.load(std::memory_order_acquire) >= RING_CAPACITY) {
+            ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+        Record& record = ring.records[head & (RING_CAPACITY - 1)];
+        record.wallNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        record.level = level;
+        record.length = 0;
+        (append(record, args), ...);
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    static void format(std::string& out, const Record& record) {
+        time_t seconds = (time_t)(record.wallNs / 1000000000);
+        struct tm timeinfo;
+        localtime_s(&timeinfo, &seconds);
+        char stamp[32];
+        size_t length = strftime(stamp, sizeof(stamp), "%H:%M:%S", &timeinfo);
+        snprintf(stamp + length, sizeof(stamp) - length, ".%03d ", (int)((record.wallNs / 1000000) % 1000));
+        out += stamp;
+        out += logLevelName(record.level);
+        out += ' ';
+        out.append(record.text, record.length);
+        out += '\n';
+    }
+
+    // Returns the number of records written
+    size_t drainOnce(std::string& batch) {
+        std::vector<Ring*>& snapshot = drainRings;
+        snapshot.clear();
+        {
+            std::lock_guard<std::mutex> lock(ringsMutex);
+            for (const auto& ring : rings) {
+                snapshot.push_back(ring.get());
+            }
+        }
+
+        size_t count = 0;
+        for (Ring* ring : snapshot) {
+            size_t tail = ring->tail.load(std::memory_order_relaxed);
+            size_t head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; ++tail) {
+                format(batch, ring->records[tail & (RING_CAPACITY - 1)]);
+                ++count;
+            }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+
+        if (!batch.empty()) {
+            fwrite(batch.data(), 1, batch.size(), output);
+            fflush(output);
+            batch.clear();
+            written.fetch_add(count, std::memory_order_relaxed);
+        }
+        return count;
+    }
+
+    void runWriter() {
+        std::string batch;
+        while (running.load(std::memory_order_relaxed)) {
+            if (drainOnce(batch) == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+        drainOnce(batch);
+    }
+
+public:
+    static AsyncLogger& instance() {
+        static AsyncLogger logger;
+        return logger;
+    }
+
+    ~AsyncLogger() {
+        stop();
+    }
+
+    void setLevel(LogLevel level) { minLevel.store(level, std::memory_order_relaxed); }
+
+    // Log one chat message in every `every`; 0 turns chat content logging off
+    void setChatSampling(uint32_t every) { chatSampleEvery.store(every, std::memory_order_relaxed); }
+
+    // Call before start()
+    bool openFile(const std::string& path) {
+        FILE* file = fopen(path.c_str(), "a");
+        if (file == nullptr) {
+            return false;
+        }
+        output = file;
+        ownsOutput = true;
+        return true;
+    }
+
+    void start() {
+        if (!running.exchange(true)) {
+            writer = std::thread(&AsyncLogger::runWriter, this);
+        }
+    }
+
+    // Writes everything logged so far, then stops the writer thread
+    void stop() {
+        if (running.exchange(false) && writer.joinable()) {
+            writer.join();
+        }
+        if (ownsOutput) {
+            fclose(output);
+            output = stdout;
+            ownsOutput = false;
+        }
+    }
+
+    // Block until every record logged before the call has been written
+    void flush() {
+        if (!running.load()) {
+            return;
+        }
+        for (;;) {
+            size_t pending = 0;
+            {
+                std::lock_guard<std::mutex> lock(ringsMutex);
+                for (const auto& ring : rings) {
+                    pending += ring->used();
+                }
+            }
+            if (pending == 0) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    bool enabled(LogLevel level) const {
+        return level >= minLevel.load(std::memory_order_relaxed);
+    }
+
+    template <typename... Args>
+    void log(LogLevel level, const Args&... args) {
+        if (!enabled(level)) {
+            return;
+        }
+        push(threadRing(), level, args...);
+    }
+
+    // Chat content: sampled, and shed before anything else under load
+    template <typename... Args>
+    void logChat(const Args&... args) {
+        uint32_t every = chatSampleEvery.load(std::memory_order_relaxed);
+        if (every == 0 || !enabled(LogLevel::Info)) {
+            return;
+        }
+        Ring& ring = threadRing();
+        if (ring.chatSeen++ % every != 0) {
+            return;
+        }
+        if (ring.used() >= RING_CAPACITY / 2) {
+            ring.shed.store(ring.shed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+        push(ring, LogLevel::Info, args...);
+    }
+
+    uint64_t writtenCount() const { return written.load(std::memory_order_relaxed); }
+
+    uint64_t droppedCount() {
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        uint64_t total = 0;
+        for (const auto& ring : rings) {
+            total += ring->dropped.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    uint64_t shedCount() {
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        uint64_t total = 0;
+        for (const auto& ring : rings) {
+            total += ring->shed.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+};
+
+template <typename... Args>
+inline void logMessage(LogLevel level, const Args&... args) {
+    AsyncLogger::instance().log(level, args...);
+}
+
+template <typename... Args>
+inline void logChat(const Args&... args) {
+    AsyncLogger::instance().logChat(args...);
+}
+
+#endif // ASYNC_LOGGER_H
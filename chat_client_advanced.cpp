@@ -2,19 +2,37 @@
 #include <thread>
 #include <string>
 #include <atomic>
-#include <windows.h>
-#include <winsock.h>
+#include <mutex>
+#include <random>
+#include <chrono>
+#include <algorithm>
 #include <ctime>
 #include <iomanip>
 #include <sstream>
+#include <map>
+#include <vector>
+#include "windows_sockets.h"
+#include "chat_protocol.h"
+#ifdef _WIN32
 #pragma comment(lib, "ws2_32.lib")
+#endif
+
+// Reconnect backoff: the cap doubles per failed attempt up to the maximum
+const unsigned RECONNECT_BASE_MS = 500;
+const unsigned RECONNECT_MAX_MS = 30000;
 
 class ChatClient {
 private:
     SOCKET clientSocket;
+    std::mutex socketMutex;            // guards clientSocket while the receiver reconnects
     std::atomic<bool> running;
+    std::mt19937 jitter;
     std::string username;
-    std::string room;
+    std::string room;                  // joined at the handshake
+    std::mutex roomsMutex;             // guards the three below, shared by the input and receiver threads
+    std::vector<std::string> rooms;    // joined rooms in /join order; chat goes to the last
+    std::map<std::string, uint64_t> lastSeq;   // newest sequence id seen per room, to resume from
+    std::string untaggedRoom;          // room of untagged messages, sent while only one room is joined
     
     std::string getCurrentTime() {
         time_t now = time(0);
@@ -39,6 +57,13 @@ private:
         std::cout.flush();
     }
     
+    void displayPrivateMessage(const std::string& message) {
+        std::cout << "\r" << std::string(80, ' ') << "\r"; // Clear current line
+        std::cout << "\033[35m" << message << "\033[0m" << std::endl; // Magenta for private messages
+        std::cout << "[" << getCurrentTime() << "] [" << username << "]: ";
+        std::cout.flush();
+    }
+    
     void displayUserMessage(const std::string& message) {
         std::cout << "\r" << std::string(80, ' ') << "\r"; // Clear current line
         std::cout << message << std::endl;
@@ -52,7 +77,7 @@ private:
     }
     
 public:
-    ChatClient() : clientSocket(INVALID_SOCKET), running(false) {}
+    ChatClient() : clientSocket(INVALID_SOCKET), running(false), jitter(std::random_device{}()) {}
     
     ~ChatClient() {
         disconnect();
@@ -91,11 +116,10 @@ public:
         std::cout << "Connecting to server...\n";
     }
     
-    bool connectToServer() {
-        clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (clientSocket == INVALID_SOCKET) {
-            std::cerr << "Socket creation failed\n";
-            return false;
+    SOCKET openConnection() {
+        SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s == INVALID_SOCKET) {
+            return INVALID_SOCKET;
         }
         
         sockaddr_in serverAddr{};
@@ -103,73 +127,249 @@ public:
         serverAddr.sin_port = htons(8080);
         serverAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
         
-        if (connect(clientSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+        if (connect(s, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+            closesocket(s);
+            return INVALID_SOCKET;
+        }
+        return s;
+    }
+    
+    bool connectToServer() {
+        SOCKET s = openConnection();
+        if (s == INVALID_SOCKET) {
             std::cerr << "Connection failed. Make sure the server is running on 127.0.0.1:8080\n";
-            closesocket(clientSocket);
-            clientSocket = INVALID_SOCKET;
             return false;
         }
         
+        std::lock_guard<std::mutex> lock(socketMutex);
+        clientSocket = s;
         std::cout << "Connected to server successfully!\n";
         return true;
     }
     
-    void sendMessage(const std::string& message) {
-        if (clientSocket != INVALID_SOCKET) {
-            send(clientSocket, message.c_str(), message.length(), 0);
+    // False while disconnected
+    bool sendRaw(const std::string& data) {
+        std::lock_guard<std::mutex> lock(socketMutex);
+        if (clientSocket == INVALID_SOCKET) {
+            return false;
         }
+        return send(clientSocket, data.c_str(), (int)data.length(), MSG_NOSIGNAL) == (int)data.length();
     }
     
+    bool sendMessage(const std::string& message) {
+        FrameType type = message[0] == '/' ? FrameType::Command : FrameType::Chat;
+        return sendRaw(encodeFrame(type, message));
+    }
+    
+    // Ask for the framed protocol; everything after this line is binary.
+    // After a reconnect, join every room again and only ask for the
+    // messages missed meanwhile.
     void sendUserInfo() {
-        std::string userInfo = username + "|" + room;
-        sendMessage(userInfo);
+        std::vector<std::pair<std::string, uint64_t>> resume;
+        {
+            std::lock_guard<std::mutex> lock(roomsMutex);
+            if (rooms.empty()) {
+                rooms.push_back(room);
+            }
+            for (const std::string& joined : rooms) {
+                resume.emplace_back(joined, lastSeq[joined]);
+            }
+            untaggedRoom = rooms.front();
+        }
+        
+        std::string userInfo = username + "|" + resume[0].first + "|" + HANDSHAKE_FRAMED_OPTION;
+        if (resume[0].second > 0) {
+            userInfo += "|";
+            userInfo += HANDSHAKE_SINCE_OPTION;
+            userInfo += std::to_string(resume[0].second);
+        }
+        sendRaw(userInfo + "\n");
+        for (size_t i = 1; i < resume.size(); ++i) {
+            std::string join = "/join " + resume[i].first;
+            if (resume[i].second > 0) {
+                join += " " + std::to_string(resume[i].second);
+            }
+            sendMessage(join);
+        }
     }
     
-    void receiverThread() {
-        char buffer[1024];
+    // Mirror /join and /leave so that a reconnect can join the same rooms.
+    // A room left behind forgets its sequence id: once nobody is in it the
+    // server may drop it, and a new one numbers its messages from 1 again.
+    void trackRoomCommand(const std::string& message) {
+        std::istringstream words(message);
+        std::string command, target;
+        words >> command >> target;
+        std::lock_guard<std::mutex> lock(roomsMutex);
+        if (command == "/join" && !target.empty()) {
+            auto it = std::find(rooms.begin(), rooms.end(), target);
+            if (it != rooms.end()) {
+                rooms.erase(it);
+            }
+            else {
+                lastSeq.erase(target);
+            }
+            rooms.push_back(target);
+        }
+        else if (command == "/leave" && rooms.size() > 1) {
+            auto it = target.empty() ? rooms.end() - 1 : std::find(rooms.begin(), rooms.end(), target);
+            if (it != rooms.end()) {
+                lastSeq.erase(*it);
+                rooms.erase(it);
+            }
+            if (rooms.size() == 1) {
+                untaggedRoom = rooms.front();
+            }
+        }
+    }
+    
+    void closeSocket() {
+        std::lock_guard<std::mutex> lock(socketMutex);
+        if (clientSocket != INVALID_SOCKET) {
+            closesocket(clientSocket);
+            clientSocket = INVALID_SOCKET;
+        }
+    }
+    
+    // Sleep in short steps so that /quit is not held up; false if stopped
+    bool sleepWhileRunning(unsigned milliseconds) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+        while (running && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        return running;
+    }
+    
+    // Exponential backoff with full jitter: each wait is random up to a cap
+    // that doubles per failure, so clients dropped by the same server restart
+    // spread their reconnects out instead of arriving in the same second
+    bool reconnect() {
+        for (unsigned attempt = 0; running; ++attempt) {
+            unsigned cap = attempt < 16 ? std::min(RECONNECT_MAX_MS, RECONNECT_BASE_MS << attempt) : RECONNECT_MAX_MS;
+            unsigned delay = std::uniform_int_distribution<unsigned>(0, cap)(jitter);
+            displaySystemMessage("Reconnecting in " + std::to_string(delay) + " ms...");
+            if (!sleepWhileRunning(delay)) {
+                return false;
+            }
+            
+            SOCKET s = openConnection();
+            if (s == INVALID_SOCKET) {
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(socketMutex);
+                if (!running) {
+                    closesocket(s);
+                    return false;
+                }
+                clientSocket = s;
+            }
+            sendUserInfo();
+            displaySystemMessage("Reconnected, resuming where the connection dropped");
+            return true;
+        }
+        return false;
+    }
+    
+    // Returns once the current connection is gone
+    void receiveMessages() {
+        char buffer[8192];
         int bytesReceived;
+        FrameParser parser;
+        parser.setMode(FrameParser::Framed);
+        SOCKET s;
+        {
+            std::lock_guard<std::mutex> lock(socketMutex);
+            s = clientSocket;
+        }
         
-        while (running && clientSocket != INVALID_SOCKET) {
-            bytesReceived = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-            
-            if (bytesReceived > 0) {
-                buffer[bytesReceived] = '\0';
-                std::string message(buffer);
-                
-                // Check if it's a system message (contains "===" or specific keywords)
-                if (message.find("===") != std::string::npos || 
-                    message.find("joined") != std::string::npos || 
-                    message.find("left") != std::string::npos ||
-                    message.find("Users in room") != std::string::npos ||
-                    message.find("Available Rooms") != std::string::npos ||
-                    message.find("Available Commands") != std::string::npos ||
-                    message.find("Unknown command") != std::string::npos) {
-                    displaySystemMessage(message);
+        auto onFrame = [this](const Frame& frame) {
+            if (frame.seq != 0) {
+                // Sequence ids count per room. Live messages at or below the
+                // resume point were already shown before the reconnect.
+                std::lock_guard<std::mutex> lock(roomsMutex);
+                uint64_t& last = lastSeq[frame.room.empty() ? untaggedRoom : std::string(frame.room)];
+                if (frame.type == FrameType::Reset) {
+                    // The server's room is behind our resume point; its
+                    // ids started over, so resume from its next id instead.
+                    last = frame.seq - 1;
+                } else if (frame.type != FrameType::History && frame.seq <= last) {
+                    return true;
+                } else if (frame.seq > last) {
+                    last = frame.seq;
                 }
-                else {
+            }
+            if (frame.type == FrameType::Ping) {
+                sendRaw(encodeFrame(FrameType::Pong, frame.payload));
+                return true;
+            }
+            std::string message(frame.payload);
+            if (!frame.room.empty()) {
+                message = "[" + std::string(frame.room) + "] " + message;
+            }
+            switch (frame.type) {
+                case FrameType::Chat:
                     displayUserMessage(message);
+                    break;
+                case FrameType::Direct:
+                    displayPrivateMessage(message);
+                    break;
+                case FrameType::System:
+                case FrameType::History:
+                case FrameType::Error:
+                default:
+                    displaySystemMessage(message);
+                    break;
+            }
+            return true;
+        };
+        
+        while (running) {
+            bytesReceived = recv(s, buffer, sizeof(buffer), 0);
+            
+            if (bytesReceived > 0) {
+                if (!parser.feed(buffer, bytesReceived, onFrame)) {
+                    displaySystemMessage("Protocol error from server.");
+                    return;
                 }
             }
             else if (bytesReceived == 0) {
-                displaySystemMessage("Server disconnected.");
-                break;
+                if (running) {
+                    displaySystemMessage("Server disconnected.");
+                }
+                return;
             }
             else {
                 int error = WSAGetLastError();
-                if (error != WSAEWOULDBLOCK) {
-                    displaySystemMessage("Connection lost. Error: " + std::to_string(error));
-                    break;
+                if (error != WSAEWOULDBLOCK && error != WSAEINTR) {
+                    if (running) {
+                        displaySystemMessage("Connection lost. Error: " + std::to_string(error));
+                    }
+                    return;
                 }
             }
         }
-        
-        running = false;
+    }
+    
+    // Receives until /quit, reconnecting whenever the connection drops
+    void receiverThread() {
+        while (running) {
+            receiveMessages();
+            closeSocket();
+            if (!running || !reconnect()) {
+                break;
+            }
+        }
     }
     
     void showHelp() {
         std::cout << "\n=== Available Commands ===\n";
         std::cout << "/list - Show users in current room\n";
         std::cout << "/rooms - Show all available rooms\n";
+        std::cout << "/join <room> - Follow another room as well and chat there\n";
+        std::cout << "/leave [room] - Stop following a room\n";
+        std::cout << "/msg <user> <text> - Send a private message\n";
+        std::cout << "/history [since] [limit] - Replay earlier messages\n";
         std::cout << "/quit - Leave the chat\n";
         std::cout << "/help - Show this help message\n";
         std::cout << "========================\n\n";
@@ -203,7 +403,9 @@ public:
         
         std::string message;
         while (running) {
-            std::getline(std::cin, message);
+            if (!std::getline(std::cin, message)) {
+                break;   // end of input
+            }
             
             if (!running) break;
             
@@ -213,7 +415,6 @@ public:
             }
             
             if (message == "/quit" || message == "/exit") {
-                running = false;
                 break;
             }
             else if (message == "/help") {
@@ -221,18 +422,20 @@ public:
                 displayPrompt();
                 continue;
             }
-            else if (message[0] == '/') {
-                // Send command to server
-                sendMessage(message);
-                displayPrompt();
+            
+            // Before sending, so the reply already finds the rooms updated
+            if (message.compare(0, 6, "/join ") == 0 || message.compare(0, 6, "/leave") == 0) {
+                trackRoomCommand(message);
+            }
+            if (!sendMessage(message)) {
+                displaySystemMessage("Not connected, message not sent.");
             }
             else {
-                // Regular message
-                sendMessage(message);
                 displayPrompt();
             }
         }
         
+        stop();
         if (receiver.joinable()) {
             receiver.join();
         }
@@ -241,8 +444,18 @@ public:
         cleanup();
     }
     
+    // Wake the receiver out of recv() so it can be joined; it closes the socket
+    void stop() {
+        std::lock_guard<std::mutex> lock(socketMutex);
+        running = false;
+        if (clientSocket != INVALID_SOCKET) {
+            shutdown(clientSocket, SD_BOTH);
+        }
+    }
+    
     void disconnect() {
         running = false;
+        std::lock_guard<std::mutex> lock(socketMutex);
         if (clientSocket != INVALID_SOCKET) {
             closesocket(clientSocket);
             clientSocket = INVALID_SOCKET;
@@ -251,6 +464,7 @@ public:
 };
 
 int main() {
+#ifdef _WIN32
     // Set console to handle UTF-8 for better display
     SetConsoleOutputCP(CP_UTF8);
     SetConsoleCP(CP_UTF8);
@@ -261,6 +475,7 @@ int main() {
     GetConsoleMode(hOut, &dwMode);
     dwMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
     SetConsoleMode(hOut, dwMode);
+#endif
     
     ChatClient client;
     client.run();
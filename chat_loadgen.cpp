@@ -0,0 +1,521 @@
+// Load generator for chat_server_enhanced.
+//
+// Opens many framed connections spread over a set of rooms, has every
+// client send chat messages at a fixed rate, and measures how long each
+// message takes to reach the other members of its room. Every payload
+// carries the sender's monotonic send time, so latency is measured end to
+// end inside this one process.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include "windows_sockets.h"
+#include "event_loop.h"
+#include "chat_protocol.h"
+#include "clock_service.h"
+#include "latency_histogram.h"
+
+struct LoadConfig {
+    std::string host = "127.0.0.1";
+    unsigned short port = 8080;
+    size_t clients = 1000;
+    size_t rooms = 10;
+    size_t threads = 0;            // 0 = half the hardware threads
+    double rate = 1.0;             // messages per second per client
+    size_t messageSize = 64;       // payload bytes, including the timing header
+    double duration = 10.0;        // seconds of sending
+    double settle = 2.0;           // max seconds to wait for welcomes before sending
+    double drain = 2.0;            // seconds to keep reading after sending stops
+    std::string jsonPath;          // "-" for stdout
+};
+
+enum class Phase { Connecting, Sending, Draining, Done };
+
+static const char* const PAYLOAD_MARKER = "LG";
+
+struct SimClient {
+    SOCKET socket = INVALID_SOCKET;
+    size_t id = 0;
+    size_t room = 0;
+    FrameParser parser;
+    std::string outbox;
+    size_t outOffset = 0;
+    uint64_t connectStartNs = 0;
+    uint64_t nextSendNs = 0;
+    bool welcomed = false;
+    bool alive = false;
+};
+
+struct Worker {
+    Poller poller;
+    std::vector<std::unique_ptr<SimClient>> clients;
+    LatencyHistogram latency;          // ns, send to delivery
+    LatencyHistogram connectTime;      // ns, connect() to welcome
+    uint64_t sent = 0;
+    uint64_t expected = 0;             // deliveries the sends should cause
+    uint64_t received = 0;
+    uint64_t connectFailures = 0;
+    uint64_t disconnects = 0;
+    std::thread thread;
+};
+
+class LoadGenerator {
+private:
+    LoadConfig config;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::unique_ptr<std::atomic<size_t>[]> roomMembers;   // welcomed clients per room
+    std::atomic<Phase> phase;
+    std::atomic<size_t> workersConnected;
+    std::atomic<size_t> welcomed;
+    uint64_t sendStartNs;
+    uint64_t sendIntervalNs;
+
+    std::string roomName(size_t room) const {
+        return "loadgen-" + std::to_string(room);
+    }
+
+    bool connectClient(Worker& worker, SimClient& client) {
+        client.connectStartNs = ClockService::monotonicNanos();
+        client.socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (client.socket == INVALID_SOCKET) {
+            return false;
+        }
+
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(config.port);
+        if (inet_pton(AF_INET, config.host.c_str(), &address.sin_addr) != 1 ||
+            connect(client.socket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+            closesocket(client.socket);
+            client.socket = INVALID_SOCKET;
+            return false;
+        }
+
+        int noDelay = 1;
+        setsockopt(client.socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+        std::string handshake = "lg" + std::to_string(client.id) + "|" + roomName(client.room) + "|" + HANDSHAKE_FRAMED_OPTION + "\n";
+        if (send(client.socket, handshake.c_str(), (int)handshake.size(), MSG_NOSIGNAL) != (int)handshake.size() ||
+            !setSocketNonBlocking(client.socket) || !worker.poller.add(client.socket, &client)) {
+            closesocket(client.socket);
+            client.socket = INVALID_SOCKET;
+            return false;
+        }
+
+        client.parser.setMode(FrameParser::Framed);
+        client.alive = true;
+        return true;
+    }
+
+    void dropClient(Worker& worker, SimClient& client) {
+        if (!client.alive) {
+            return;
+        }
+        client.alive = false;
+        if (client.welcomed) {
+            roomMembers[client.room]--;
+        }
+        worker.poller.remove(client.socket);
+        closesocket(client.socket);
+        client.socket = INVALID_SOCKET;
+        if (phase.load() != Phase::Done) {
+            worker.disconnects++;
+        }
+    }
+
+    // Chat payloads look like "[HH:MM:SS] lg12: LG12:<sendNs>:xxxx"
+    void recordDelivery(Worker& worker, std::string_view payload, uint64_t nowNs) {
+        size_t marker = payload.find(std::string(": ") + PAYLOAD_MARKER);
+        if (marker == std::string_view::npos) {
+            return;
+        }
+        size_t sentAt = payload.find(':', marker + 2);
+        if (sentAt == std::string_view::npos) {
+            return;
+        }
+        uint64_t sendNs = 0;
+        for (size_t i = sentAt + 1; i < payload.size() && payload[i] >= '0' && payload[i] <= '9'; ++i) {
+            sendNs = sendNs * 10 + (uint64_t)(payload[i] - '0');
+        }
+        worker.received++;
+        worker.latency.record(nowNs > sendNs ? nowNs - sendNs : 0);
+    }
+
+    void handleReadable(Worker& worker, SimClient& client) {
+        char buffer[16384];
+        while (client.alive) {
+            int received = recv(client.socket, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                if (received < 0 && socketWouldBlock(WSAGetLastError())) {
+                    return;
+                }
+                if (received < 0 && WSAGetLastError() == WSAEINTR) {
+                    continue;
+                }
+                dropClient(worker, client);
+                return;
+            }
+
+            uint64_t nowNs = ClockService::monotonicNanos();
+            bool ok = client.parser.feed(buffer, (size_t)received, [&](const Frame& frame) {
+                if (frame.type == FrameType::Chat) {
+                    recordDelivery(worker, frame.payload, nowNs);
+                }
+                else if (frame.type == FrameType::Ping) {
+                    client.outbox += encodeFrame(FrameType::Pong, frame.payload);
+                }
+                else if (frame.type == FrameType::System && !client.welcomed) {
+                    client.welcomed = true;
+                    worker.connectTime.record(nowNs - client.connectStartNs);
+                    roomMembers[client.room]++;
+                    welcomed++;
+                }
+                return true;
+            });
+            if (!ok) {
+                dropClient(worker, client);
+                return;
+            }
+            if (!client.outbox.empty()) {
+                flush(worker, client);
+            }
+        }
+    }
+
+    void flush(Worker& worker, SimClient& client) {
+        while (client.alive && client.outOffset < client.outbox.size()) {
+            int sent = send(client.socket, client.outbox.data() + client.outOffset,
+                            (int)(client.outbox.size() - client.outOffset), MSG_NOSIGNAL);
+            if (sent == SOCKET_ERROR) {
+                int error = WSAGetLastError();
+                if (socketWouldBlock(error)) {
+                    worker.poller.setWriteInterest(client.socket, &client, true);
+                    return;
+                }
+                if (error == WSAEINTR) {
+                    continue;
+                }
+                dropClient(worker, client);
+                return;
+            }
+            client.outOffset += (size_t)sent;
+        }
+        if (!client.alive) {
+            return;
+        }
+        client.outbox.clear();
+        client.outOffset = 0;
+        worker.poller.setWriteInterest(client.socket, &client, false);
+    }
+
+    void queueMessage(Worker& worker, SimClient& client, uint64_t nowNs) {
+        std::string payload = std::string(PAYLOAD_MARKER) + std::to_string(client.id) + ":" + std::to_string(nowNs) + ":";
+        if (payload.size() < config.messageSize) {
+            payload.append(config.messageSize - payload.size(), 'x');
+        }
+        client.outbox += encodeFrame(FrameType::Chat, payload);
+
+        size_t members = roomMembers[client.room].load();
+        worker.sent++;
+        worker.expected += members > 0 ? members - 1 : 0;
+    }
+
+    // Milliseconds until the next client is due to send, capped so phase
+    // changes are noticed promptly
+    int sendTimeoutMs(Worker& worker, uint64_t nowNs) {
+        uint64_t earliest = nowNs + 10 * 1000000ULL;
+        for (const auto& client : worker.clients) {
+            if (client->alive && client->welcomed && client->nextSendNs < earliest) {
+                earliest = client->nextSendNs;
+            }
+        }
+        return earliest <= nowNs ? 0 : (int)((earliest - nowNs + 999999) / 1000000);
+    }
+
+    void sendDue(Worker& worker) {
+        uint64_t nowNs = ClockService::monotonicNanos();
+        for (const auto& clientPtr : worker.clients) {
+            SimClient& client = *clientPtr;
+            if (!client.alive || !client.welcomed || client.nextSendNs > nowNs) {
+                continue;
+            }
+            while (client.nextSendNs <= nowNs) {
+                queueMessage(worker, client, nowNs);
+                client.nextSendNs += sendIntervalNs;
+            }
+            flush(worker, client);
+        }
+    }
+
+    void runWorker(Worker& worker) {
+        for (const auto& client : worker.clients) {
+            if (!connectClient(worker, *client)) {
+                worker.connectFailures++;
+            }
+        }
+        workersConnected++;
+
+        std::vector<PollEvent> events;
+        bool scheduled = false;
+        while (phase.load() != Phase::Done) {
+            bool sending = phase.load() == Phase::Sending;
+            if (sending && !scheduled) {
+                // Spread first sends over one interval so clients do not fire in lockstep
+                std::mt19937_64 random(worker.clients.empty() ? 0 : worker.clients.front()->id);
+                for (const auto& client : worker.clients) {
+                    client->nextSendNs = sendStartNs + random() % sendIntervalNs;
+                }
+                scheduled = true;
+            }
+            int timeoutMs = sending ? sendTimeoutMs(worker, ClockService::monotonicNanos()) : 10;
+
+            worker.poller.wait(events, timeoutMs);
+            for (const PollEvent& event : events) {
+                SimClient& client = *static_cast<SimClient*>(event.tag);
+                if (event.writable && client.alive) {
+                    flush(worker, client);
+                }
+                if (event.readable && client.alive) {
+                    handleReadable(worker, client);
+                }
+            }
+
+            if (sending && phase.load() == Phase::Sending) {
+                sendDue(worker);
+            }
+        }
+
+        for (const auto& client : worker.clients) {
+            dropClient(worker, *client);
+        }
+    }
+
+    static void sleepSeconds(double seconds) {
+        std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(seconds * 1e6)));
+    }
+
+    static double toMicros(uint64_t ns) {
+        return (double)ns / 1000.0;
+    }
+
+    void writeDistribution(std::ostream& out, const LatencyHistogram& histogram) {
+        out << "{\"count\": " << histogram.count()
+            << ", \"mean_us\": " << toMicros((uint64_t)histogram.mean())
+            << ", \"p50_us\": " << toMicros(histogram.percentile(0.50))
+            << ", \"p99_us\": " << toMicros(histogram.percentile(0.99))
+            << ", \"p999_us\": " << toMicros(histogram.percentile(0.999))
+            << ", \"max_us\": " << toMicros(histogram.max()) << "}";
+    }
+
+public:
+    explicit LoadGenerator(const LoadConfig& cfg)
+        : config(cfg), roomMembers(new std::atomic<size_t>[std::max<size_t>(1, cfg.rooms)]),
+          phase(Phase::Connecting), workersConnected(0), welcomed(0), sendStartNs(0), sendIntervalNs(1) {
+        config.rooms = std::max<size_t>(1, config.rooms);
+        for (size_t i = 0; i < config.rooms; ++i) {
+            roomMembers[i] = 0;
+        }
+        if (config.threads == 0) {
+            config.threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+        }
+        config.threads = std::max<size_t>(1, std::min(config.threads, std::max<size_t>(1, config.clients)));
+        sendIntervalNs = config.rate > 0 ? std::max<uint64_t>(1, (uint64_t)(1e9 / config.rate)) : UINT64_MAX / 4;
+    }
+
+    int run() {
+        for (size_t i = 0; i < config.threads; ++i) {
+            workers.push_back(std::make_unique<Worker>());
+        }
+        for (size_t id = 0; id < config.clients; ++id) {
+            auto client = std::make_unique<SimClient>();
+            client->id = id;
+            client->room = id % config.rooms;
+            workers[id % config.threads]->clients.push_back(std::move(client));
+        }
+        for (auto& worker : workers) {
+            if (!worker->poller.valid()) {
+                std::cerr << "Failed to create poller\n";
+                return 1;
+            }
+        }
+
+        std::cerr << "Connecting " << config.clients << " clients to " << config.host << ":" << config.port
+                  << " across " << config.rooms << " rooms on " << config.threads << " threads\n";
+        uint64_t connectStartNs = ClockService::monotonicNanos();
+        for (auto& worker : workers) {
+            Worker* w = worker.get();
+            worker->thread = std::thread([this, w]() { runWorker(*w); });
+        }
+
+        while (workersConnected.load() < workers.size()) {
+            sleepSeconds(0.01);
+        }
+        uint64_t settleDeadline = ClockService::monotonicNanos() + (uint64_t)(config.settle * 1e9);
+        size_t attempted = 0;
+        for (auto& worker : workers) {
+            attempted += worker->clients.size() - worker->connectFailures;
+        }
+        while (welcomed.load() < attempted && ClockService::monotonicNanos() < settleDeadline) {
+            sleepSeconds(0.01);
+        }
+        double connectSeconds = (double)(ClockService::monotonicNanos() - connectStartNs) / 1e9;
+        std::cerr << welcomed.load() << " clients joined in " << connectSeconds << " s, sending for "
+                  << config.duration << " s\n";
+
+        sendStartNs = ClockService::monotonicNanos();
+        phase = Phase::Sending;
+        sleepSeconds(config.duration);
+        uint64_t sendEndNs = ClockService::monotonicNanos();
+        phase = Phase::Draining;
+        sleepSeconds(config.drain);
+        phase = Phase::Done;
+
+        for (auto& worker : workers) {
+            worker->thread.join();
+        }
+
+        LatencyHistogram latency;
+        LatencyHistogram connectTime;
+        uint64_t sent = 0, expected = 0, received = 0, connectFailures = 0, disconnects = 0;
+        for (auto& worker : workers) {
+            latency.merge(worker->latency);
+            connectTime.merge(worker->connectTime);
+            sent += worker->sent;
+            expected += worker->expected;
+            received += worker->received;
+            connectFailures += worker->connectFailures;
+            disconnects += worker->disconnects;
+        }
+        uint64_t dropped = expected > received ? expected - received : 0;
+        double sendSeconds = (double)(sendEndNs - sendStartNs) / 1e9;
+
+        std::ostringstream json;
+        json << "{\n"
+             << "  \"config\": {\"clients\": " << config.clients << ", \"rooms\": " << config.rooms
+             << ", \"threads\": " << config.threads << ", \"rate\": " << config.rate
+             << ", \"message_size\": " << config.messageSize << ", \"duration_s\": " << config.duration << "},\n"
+             << "  \"connections\": {\"attempted\": " << config.clients << ", \"joined\": " << welcomed.load()
+             << ", \"failed\": " << connectFailures << ", \"disconnected\": " << disconnects << "},\n"
+             << "  \"connect_time\": ";
+        writeDistribution(json, connectTime);
+        json << ",\n"
+             << "  \"messages\": {\"sent\": " << sent << ", \"expected_deliveries\": " << expected
+             << ", \"delivered\": " << received << ", \"dropped\": " << dropped << "},\n"
+             << "  \"throughput\": {\"sent_per_s\": " << (double)sent / sendSeconds
+             << ", \"delivered_per_s\": " << (double)received / sendSeconds << "},\n"
+             << "  \"latency\": ";
+        writeDistribution(json, latency);
+        json << "\n}\n";
+
+        std::cout << "Sent " << sent << " messages (" << (uint64_t)((double)sent / sendSeconds) << "/s), delivered "
+                  << received << " of " << expected << " (" << dropped << " dropped)\n"
+                  << "Latency us: p50 " << toMicros(latency.percentile(0.50))
+                  << ", p99 " << toMicros(latency.percentile(0.99))
+                  << ", p999 " << toMicros(latency.percentile(0.999))
+                  << ", max " << toMicros(latency.max()) << "\n"
+                  << "Connect us: p50 " << toMicros(connectTime.percentile(0.50))
+                  << ", p99 " << toMicros(connectTime.percentile(0.99))
+                  << ", max " << toMicros(connectTime.max()) << "\n";
+
+        if (config.jsonPath == "-") {
+            std::cout << json.str();
+        }
+        else if (!config.jsonPath.empty()) {
+            std::ofstream file(config.jsonPath);
+            if (!file) {
+                std::cerr << "Cannot write " << config.jsonPath << "\n";
+                return 1;
+            }
+            file << json.str();
+        }
+        return 0;
+    }
+};
+
+static void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [--host ADDR] [--port N] [--clients N] [--rooms N] [--threads N]\n"
+              << "       [--rate MESSAGES_PER_SEC] [--size BYTES] [--duration SECONDS]\n"
+              << "       [--settle SECONDS] [--drain SECONDS] [--json FILE|-]\n";
+}
+
+static bool parseArguments(int argc, char* argv[], LoadConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--host") {
+            config.host = value;
+        }
+        else if (arg == "--port") {
+            config.port = (unsigned short)std::atoi(value);
+        }
+        else if (arg == "--clients") {
+            config.clients = (size_t)std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--rooms") {
+            config.rooms = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--threads") {
+            config.threads = (size_t)std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--rate") {
+            config.rate = std::atof(value);
+        }
+        else if (arg == "--size") {
+            config.messageSize = std::min<size_t>(MAX_FRAME_PAYLOAD, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--duration") {
+            config.duration = std::atof(value);
+        }
+        else if (arg == "--settle") {
+            config.settle = std::atof(value);
+        }
+        else if (arg == "--drain") {
+            config.drain = std::atof(value);
+        }
+        else if (arg == "--json") {
+            config.jsonPath = value;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    LoadConfig config;
+    if (!parseArguments(argc, argv, config)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed\n";
+        return 1;
+    }
+#ifndef _WIN32
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+    raiseFileDescriptorLimit();
+
+    LoadGenerator generator(config);
+    int result = generator.run();
+
+    WSACleanup();
+    return result;
+}
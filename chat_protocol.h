@@ -0,0 +1,372 @@
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "shared_buffer.h"
+
+// Wire format shared by the server and the clients.
+//
+// A connection starts with a text handshake line:
+//     USERNAME|ROOM[|option...]\n
+// Listing the "framed" option switches both directions to binary frames
+// right after the handshake line; otherwise the connection stays in the
+// legacy text mode where every message is one newline-terminated line.
+// "since=N" asks for the room messages after sequence id N instead of the
+// usual recent history. If the room's ids have started over since (a
+// server restart without durable history, or an evicted room that had no
+// log), N is ahead of the room: the server answers with a Reset frame and
+// the recent history instead.
+//
+// Frame layout: 4-byte big-endian payload length, 1-byte FrameType, payload.
+// Messages that belong to a room's history are sent sequenced: the type
+// byte has FRAME_SEQUENCED set and the payload starts with the message's
+// 8-byte big-endian per-room sequence id (counted in the length).
+//
+// A connection that follows several rooms (/join) gets room messages
+// tagged: the type byte also has FRAME_ROOM_TAGGED set, and after the
+// sequence id comes a 1-byte room name length and the name. In text mode
+// the line starts with "[ROOM] " instead.
+
+enum class FrameType : uint8_t {
+    Chat = 1,       // room chat line
+    Command = 2,    // slash command (client to server)
+    System = 3,     // server notices: joins, leaves, command output
+    History = 4,    // room history replay
+    Error = 5,      // request rejected
+    Ping = 6,       // keepalive probe; answer with a Pong carrying the same payload
+    Pong = 7,       // keepalive answer
+    Direct = 8,     // private message from /msg
+    Reset = 9       // the room's sequence ids started over; sequenced with the room's next id
+};
+
+const size_t FRAME_HEADER_SIZE = 5;
+const size_t FRAME_SEQUENCE_SIZE = 8;
+const size_t SEQUENCED_HEADER_SIZE = FRAME_HEADER_SIZE + FRAME_SEQUENCE_SIZE;
+const uint8_t FRAME_SEQUENCED = 0x80;
+const uint8_t FRAME_ROOM_TAGGED = 0x40;
+const size_t MAX_ROOM_NAME = 255;     // fits the tag's length byte
+const uint32_t MAX_FRAME_PAYLOAD = 64 * 1024;
+const char* const HANDSHAKE_FRAMED_OPTION = "framed";
+const char* const HANDSHAKE_SINCE_OPTION = "since=";
+
+inline bool isValidFrameType(uint8_t type) {
+    type &= (uint8_t)~(FRAME_SEQUENCED | FRAME_ROOM_TAGGED);
+    return type >= (uint8_t)FrameType::Chat && type <= (uint8_t)FrameType::Reset;
+}
+
+inline void writeFrameHeader(char* out, FrameType type, size_t payloadLength) {
+    uint32_t length = (uint32_t)payloadLength;
+    out[0] = (char)((length >> 24) & 0xff);
+    out[1] = (char)((length >> 16) & 0xff);
+    out[2] = (char)((length >> 8) & 0xff);
+    out[3] = (char)(length & 0xff);
+    out[4] = (char)type;
+}
+
+inline uint32_t readFrameLength(const char* header) {
+    const unsigned char* bytes = (const unsigned char*)header;
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+           ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+}
+
+// Header plus sequence id, SEQUENCED_HEADER_SIZE bytes
+inline void writeSequencedHeader(char* out, FrameType type, uint64_t seq, size_t payloadLength) {
+    writeFrameHeader(out, type, FRAME_SEQUENCE_SIZE + payloadLength);
+    out[4] = (char)((uint8_t)type | FRAME_SEQUENCED);
+    for (int i = 0; i < 8; ++i) {
+        out[FRAME_HEADER_SIZE + i] = (char)((seq >> (56 - 8 * i)) & 0xff);
+    }
+}
+
+// Header, sequence id if any and room tag, roomTaggedHeaderSize() bytes
+inline size_t roomTaggedHeaderSize(uint64_t seq, std::string_view room) {
+    return (seq != 0 ? SEQUENCED_HEADER_SIZE : FRAME_HEADER_SIZE) + 1 + room.size();
+}
+
+inline void writeRoomTaggedHeader(char* out, FrameType type, uint64_t seq, std::string_view room, size_t payloadLength) {
+    size_t tagOffset = FRAME_HEADER_SIZE;
+    if (seq != 0) {
+        writeSequencedHeader(out, type, seq, 1 + room.size() + payloadLength);
+        tagOffset = SEQUENCED_HEADER_SIZE;
+    }
+    else {
+        writeFrameHeader(out, type, 1 + room.size() + payloadLength);
+    }
+    out[4] = (char)((uint8_t)out[4] | FRAME_ROOM_TAGGED);
+    out[tagOffset] = (char)(uint8_t)room.size();
+    memcpy(out + tagOffset + 1, room.data(), room.size());
+}
+
+inline uint64_t readFrameSequence(const char* bytes) {
+    uint64_t seq = 0;
+    for (int i = 0; i < 8; ++i) {
+        seq = (seq << 8) | (uint8_t)bytes[i];
+    }
+    return seq;
+}
+
+inline std::string encodeFrame(FrameType type, std::string_view payload) {
+    std::string frame(FRAME_HEADER_SIZE + payload.size(), '\0');
+    writeFrameHeader(&frame[0], type, payload.size());
+    memcpy(&frame[FRAME_HEADER_SIZE], payload.data(), payload.size());
+    return frame;
+}
+
+// Encode once for every recipient. The block holds the framed form
+// (header [+ sequence id] + payload) followed by a newline unless the
+// payload already ends with one, so the legacy text form is a sub-slice of
+// the same allocation. A seq of 0 means the message is not sequenced.
+//
+// With a room the message is tagged, and the text form ("[ROOM] " prefix)
+// follows the framed one in the same block instead of overlapping it.
+inline SharedBuffer encodeSharedMessage(FrameType type, std::string_view payload, uint64_t seq = 0,
+                                        std::string_view room = std::string_view()) {
+    if (!room.empty()) {
+        size_t framedSize = roomTaggedHeaderSize(seq, room) + payload.size();
+        bool addNewline = payload.empty() || payload.back() != '\n';
+        SharedBuffer encoded = SharedBuffer::allocate(framedSize + room.size() + 3 + payload.size() + (addNewline ? 1 : 0));
+        char* out = encoded.writableData();
+        writeRoomTaggedHeader(out, type, seq, room, payload.size());
+        memcpy(out + framedSize - payload.size(), payload.data(), payload.size());
+        out += framedSize;
+        *out++ = '[';
+        memcpy(out, room.data(), room.size());
+        out += room.size();
+        *out++ = ']';
+        *out++ = ' ';
+        memcpy(out, payload.data(), payload.size());
+        if (addNewline) {
+            out[payload.size()] = '\n';
+        }
+        return encoded;
+    }
+    size_t headerSize = seq != 0 ? SEQUENCED_HEADER_SIZE : FRAME_HEADER_SIZE;
+    bool addNewline = payload.empty() || payload.back() != '\n';
+    SharedBuffer encoded = SharedBuffer::allocate(headerSize + payload.size() + (addNewline ? 1 : 0));
+    char* out = encoded.writableData();
+    if (seq != 0) {
+        writeSequencedHeader(out, type, seq, payload.size());
+    }
+    else {
+        writeFrameHeader(out, type, payload.size());
+    }
+    memcpy(out + headerSize, payload.data(), payload.size());
+    if (addNewline) {
+        out[headerSize + payload.size()] = '\n';
+    }
+    return encoded;
+}
+
+// The bytes of an encodeSharedMessage() result to put on the wire
+inline SharedBuffer wireView(const SharedBuffer& encoded, bool framed) {
+    size_t framedSize = FRAME_HEADER_SIZE + readFrameLength(encoded.data());
+    if (framed) {
+        return encoded.slice(0, framedSize);
+    }
+    uint8_t flags = (uint8_t)encoded.data()[4];
+    if (flags & FRAME_ROOM_TAGGED) {
+        return encoded.slice(framedSize, encoded.size() - framedSize);
+    }
+    size_t headerSize = (flags & FRAME_SEQUENCED) ? SEQUENCED_HEADER_SIZE : FRAME_HEADER_SIZE;
+    return encoded.slice(headerSize, encoded.size() - headerSize);
+}
+
+// An untagged encodeSharedMessage() result encoded again, tagged with `room`
+inline SharedBuffer tagSharedMessage(const SharedBuffer& encoded, std::string_view room) {
+    uint8_t flags = (uint8_t)encoded.data()[4];
+    size_t headerSize = (flags & FRAME_SEQUENCED) ? SEQUENCED_HEADER_SIZE : FRAME_HEADER_SIZE;
+    uint64_t seq = (flags & FRAME_SEQUENCED) ? readFrameSequence(encoded.data() + FRAME_HEADER_SIZE) : 0;
+    std::string_view payload(encoded.data() + headerSize,
+                             FRAME_HEADER_SIZE + readFrameLength(encoded.data()) - headerSize);
+    return encodeSharedMessage((FrameType)(flags & ~FRAME_SEQUENCED), payload, seq, room);
+}
+
+struct Frame {
+    FrameType type;
+    std::string_view payload;
+    uint64_t seq;     // per-room sequence id, 0 if the frame is not sequenced
+    std::string_view room;   // room the message belongs to, if tagged
+};
+
+// Incremental decoder for one connection's input stream. Complete frames
+// (or lines) inside the buffer passed to feed() are handed out as views
+// into that buffer; only a trailing partial frame is copied, so the common
+// case never allocates. The handler returns false to stop parsing.
+class FrameParser {
+public:
+    enum Mode { Text, Framed };
+
+private:
+    Mode mode;
+    std::string pending;
+
+    template <typename Handler>
+    bool deliverLine(std::string_view line, Handler& handler) {
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.empty()) {
+            return true;
+        }
+        Frame frame{line[0] == '/' ? FrameType::Command : FrameType::Chat, line, 0, std::string_view()};
+        return handler(frame);
+    }
+
+    // Returns false if the header announces something we refuse to buffer
+    bool checkHeader(const char* header, uint32_t& payloadLength) const {
+        payloadLength = readFrameLength(header);
+        uint8_t flags = (uint8_t)header[4];
+        size_t prefix = ((flags & FRAME_SEQUENCED) ? FRAME_SEQUENCE_SIZE : 0) + ((flags & FRAME_ROOM_TAGGED) ? 1 : 0);
+        return payloadLength <= MAX_FRAME_PAYLOAD + FRAME_SEQUENCE_SIZE + 1 + MAX_ROOM_NAME &&
+               isValidFrameType(flags) && payloadLength >= prefix;
+    }
+
+    // `body` holds the payloadLength bytes that follow the header. Returns
+    // false if the room tag runs past the payload.
+    static bool makeFrame(const char* header, const char* body, uint32_t payloadLength, Frame& frame) {
+        uint8_t flags = (uint8_t)header[4];
+        std::string_view payload(body, payloadLength);
+        frame.type = (FrameType)(flags & ~(FRAME_SEQUENCED | FRAME_ROOM_TAGGED));
+        frame.seq = 0;
+        frame.room = std::string_view();
+        if (flags & FRAME_SEQUENCED) {
+            frame.seq = readFrameSequence(body);
+            payload.remove_prefix(FRAME_SEQUENCE_SIZE);
+        }
+        if (flags & FRAME_ROOM_TAGGED) {
+            size_t roomLength = (uint8_t)payload[0];
+            if (payload.size() < 1 + roomLength) {
+                return false;
+            }
+            frame.room = payload.substr(1, roomLength);
+            payload.remove_prefix(1 + roomLength);
+        }
+        frame.payload = payload;
+        return true;
+    }
+
+public:
+    FrameParser() : mode(Text) {}
+
+    Mode getMode() const { return mode; }
+
+    // Takes effect from the next byte; handlers may switch mid-buffer
+    void setMode(Mode m) { mode = m; }
+
+    size_t bufferedBytes() const { return pending.size(); }
+
+    // Returns false on a protocol violation
+    template <typename Handler>
+    bool feed(const char* data, size_t length, Handler&& handler) {
+        size_t consumed;
+        return feed(data, length, handler, consumed);
+    }
+
+    // The same, and if the handler stops early `consumed` says how much of
+    // `data` was used, so the rest can be fed again later
+    template <typename Handler>
+    bool feed(const char* data, size_t length, Handler&& handler, size_t& consumed) {
+        size_t pos = 0;
+        consumed = length;
+
+        while (pos < length) {
+            const char* cursor = data + pos;
+            size_t available = length - pos;
+
+            if (mode == Text) {
+                const char* newline = (const char*)memchr(cursor, '\n', available);
+                if (newline == nullptr) {
+                    if (pending.size() + available > MAX_FRAME_PAYLOAD) {
+                        return false;
+                    }
+                    pending.append(cursor, available);
+                    return true;
+                }
+
+                size_t lineLength = newline - cursor;
+                pos += lineLength + 1;
+                bool keepGoing;
+                if (pending.empty()) {
+                    keepGoing = deliverLine(std::string_view(cursor, lineLength), handler);
+                }
+                else {
+                    pending.append(cursor, lineLength);
+                    keepGoing = deliverLine(pending, handler);
+                    pending.clear();
+                }
+                if (!keepGoing) {
+                    consumed = pos;
+                    return true;
+                }
+                continue;
+            }
+
+            uint32_t payloadLength;
+            if (pending.empty()) {
+                if (available < FRAME_HEADER_SIZE) {
+                    pending.assign(cursor, available);
+                    return true;
+                }
+                if (!checkHeader(cursor, payloadLength)) {
+                    return false;
+                }
+                size_t total = FRAME_HEADER_SIZE + payloadLength;
+                if (available < total) {
+                    pending.reserve(total);
+                    pending.assign(cursor, available);
+                    return true;
+                }
+                pos += total;
+                Frame frame;
+                if (!makeFrame(cursor, cursor + FRAME_HEADER_SIZE, payloadLength, frame)) {
+                    return false;
+                }
+                if (!handler(frame)) {
+                    consumed = pos;
+                    return true;
+                }
+                continue;
+            }
+
+            // Complete the header, then the payload, of a frame split across reads
+            if (pending.size() < FRAME_HEADER_SIZE) {
+                size_t take = std::min(FRAME_HEADER_SIZE - pending.size(), available);
+                pending.append(cursor, take);
+                pos += take;
+                if (pending.size() < FRAME_HEADER_SIZE) {
+                    return true;
+                }
+                cursor = data + pos;
+                available = length - pos;
+            }
+            if (!checkHeader(pending.data(), payloadLength)) {
+                return false;
+            }
+            size_t total = FRAME_HEADER_SIZE + payloadLength;
+            size_t take = std::min(total - pending.size(), available);
+            pending.append(cursor, take);
+            pos += take;
+            if (pending.size() < total) {
+                return true;
+            }
+            Frame frame;
+            if (!makeFrame(pending.data(), pending.data() + FRAME_HEADER_SIZE, payloadLength, frame)) {
+                return false;
+            }
+            bool keepGoing = handler(frame);
+            pending.clear();
+            if (!keepGoing) {
+                consumed = pos;
+                return true;
+            }
+        }
+
+        return true;
+    }
+};
+
+#endif // CHAT_PROTOCOL_H
@@ -5,144 +5,2482 @@
 #include <string>
 #include <algorithm>
 #include <map>
+#include <deque>
+#include <list>
+#include <tuple>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
 #include <sstream>
 #include <ctime>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
 #include "windows_sockets.h"
+#include "event_loop.h"
+#include "chat_protocol.h"
+#include "shared_buffer.h"
+#include "message_history.h"
+#include "client_registry.h"
+#include "clock_service.h"
+#include "latency_histogram.h"
+#include "metrics.h"
+#include "async_logger.h"
+#include "room_log.h"
+#include "timer_wheel.h"
+#include "rate_limiter.h"
+#include "command_table.h"
+#include "slab_allocator.h"
+#include "name_table.h"
+#include "session_task.h"
+#include "user_directory.h"
 
-struct Client {
+// Calls into the global allocator, counted so that /stats can show steady
+// chat traffic making none: its buffers come from the shards' SlabPools.
+// Slabs themselves are reported separately (they use aligned new).
+static std::atomic<uint64_t> globalAllocations(0);
+
+void* operator new(size_t size) {
+    globalAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size > 0 ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+// Room members partitioned by owning shard. A published snapshot is never
+// modified: joins and leaves copy it, edit the copy and swap it in.
+struct MemberSnapshot {
+    std::vector<std::vector<SOCKET>> byShard;
+    size_t total;
+    uint64_t version;     // newer snapshots of a room have higher versions
+    
+    explicit MemberSnapshot(size_t shardCount) : byShard(shardCount), total(0), version(0) {}
+};
+
+// Rooms are reached through shared_ptr so that a room's history and
+// members can be used without holding the directory lock. A room nobody
+// has joined is idle: it stays resident until the directory needs its
+// memory back and evicts it (see ChatServer::evictIdleRooms).
+struct Room {
+    const std::string name;
+    MessageHistory history;          // guarded by roomMutex
+    std::shared_ptr<RoomLog> log;    // durable history; null without --data-dir
+    std::mutex roomMutex;
+    std::mutex membersMutex;         // serializes snapshot writers
+    std::shared_ptr<const MemberSnapshot> members;
+    SharedBuffer listReply;          // encoded /list reply, empty when stale; guarded by membersMutex
+    TokenBucket rateBucket;          // chat messages into the room, from any shard
+    
+    // Message rate over one-second windows, guarded by roomMutex
+    uint64_t messageCount;
+    uint64_t rateWindowStartNs;
+    uint64_t rateWindowMessages;
+    double lastRate;
+    size_t chargedBytes;             // counted against the room memory budget; guarded by roomMutex
+    
+    // Lifecycle, guarded by the directory lock
+    size_t subscribers;              // connections that joined or are joining
+    bool idle;
+    std::list<Room*>::iterator idleEntry;   // place in the directory's idle list while idle
+    
+    Room(const std::string& roomName, size_t historyMessages, size_t historyBytes, size_t shardCount)
+        : name(roomName), history(historyMessages, historyBytes), members(std::make_shared<MemberSnapshot>(shardCount)),
+          messageCount(0), rateWindowStartNs(ClockService::monotonicNanos()), rateWindowMessages(0), lastRate(0),
+          chargedBytes(0), subscribers(0), idle(false) {}
+    
+    // What the room keeps whether or not anyone is in it; its history grows
+    // up to the slab size as messages arrive. Caller holds roomMutex.
+    size_t chargeableBytes() const {
+        return sizeof(Room) + name.capacity() + history.bytesReserved();
+    }
+    
+    // What its members cost on top: the snapshot and the cached /list
+    // reply. Caller holds membersMutex.
+    size_t memberBytes() const {
+        size_t bytes = sizeof(MemberSnapshot) + members->byShard.capacity() * sizeof(std::vector<SOCKET>);
+        for (const auto& sockets : members->byShard) {
+            bytes += sockets.capacity() * sizeof(SOCKET);
+        }
+        return bytes + listReply.size();
+    }
+    
+    // Caller holds roomMutex
+    void countMessage(uint64_t nowNs) {
+        ++messageCount;
+        if (nowNs - rateWindowStartNs >= 1000000000ULL) {
+            lastRate = (double)rateWindowMessages * 1e9 / (double)(nowNs - rateWindowStartNs);
+            rateWindowStartNs = nowNs;
+            rateWindowMessages = 0;
+        }
+        ++rateWindowMessages;
+    }
+    
+    // Messages per second over the last complete window; caller holds roomMutex
+    double messageRate(uint64_t nowNs) const {
+        uint64_t elapsed = nowNs - rateWindowStartNs;
+        if (elapsed >= 2000000000ULL) {
+            return (double)rateWindowMessages * 1e9 / (double)elapsed;
+        }
+        return lastRate;
+    }
+    
+    // Readers never block writers and never see a half-updated list
+    std::shared_ptr<const MemberSnapshot> memberSnapshot() const {
+        return std::atomic_load(&members);
+    }
+    
+    size_t memberCount() const {
+        return memberSnapshot()->total;
+    }
+};
+
+struct Shard;
+
+// A history replay in progress. Records are queued a chunk at a time as the
+// connection's outbound queue drains, so a long replay never floods the
+// queue or holds a room lock for long.
+struct HistoryCursor {
+    std::shared_ptr<Room> room;
+    uint64_t nextSeq;      // next sequence id to send
+    uint64_t lastSeq;      // newest id the replay covers; later ones arrive live
+    size_t remaining;      // records the request still allows
+    bool admitted;         // holds one of the shard's replay slots
+    std::unique_ptr<HistoryCursor> next;   // replay queued behind this one, e.g. for a second /join
+};
+
+// 512 slots of 100 ms: one revolution covers 51.2 s
+const size_t TIMER_WHEEL_SLOTS = 512;
+const int TIMER_TICK_MS = 100;
+
+// One room a connection has joined
+struct RoomSubscription {
+    InternedName name;
+    std::shared_ptr<Room> room;
+    uint64_t joinedSeq = 0;   // newest room message when joining: the replay covers it and those before
+};
+
+const size_t MAX_ROOMS_PER_CONNECTION = 16;
+
+// Per-socket state owned by one shard's event loop. Outgoing messages wait
+// in a bounded queue that the shard flushes after each batch of events, or
+// once the poller reports the socket writable again.
+struct Connection {
     SOCKET socket;
-    std::string username;
-    std::string room;
-    bool connected;
+    Shard* shard;
+    InternedName username;
+    std::vector<RoomSubscription, SlabAllocator<RoomSubscription>> rooms;   // joined rooms; chat goes to the last
+    bool userInfoReceived;
+    bool writable;
+    bool writeInterest;
+    bool closing;
+    bool flushScheduled;
+    bool flushHeld;          // waiting in shard.heldFlush for the flush window
+    bool batching;           // busy enough that small flushes wait for the window
+    uint32_t burstMessages;  // output queued since burstStartNs
+    uint64_t burstStartNs;
+    FrameParser parser;
+    std::deque<SharedBuffer, SlabAllocator<SharedBuffer>> outQueue;
+    size_t outQueueBytes;
+    size_t outOffset;     // bytes of outQueue.front() already written
+    uint64_t lastReceiveNs;  // when the bytes being parsed were read
+    std::unique_ptr<HistoryCursor> history;   // replay still streaming, if any
+    TimerWheel::Timer timer; // handshake deadline, then idle/ping deadline
+    uint64_t pingSentNs;     // outstanding keepalive probe, 0 if none
+    uint32_t peerAddress;    // IPv4 source address, host order
+    TokenBucket rateBucket;
+    bool rateNoticeSent;     // told about a shed message since the last accepted one
+    bool holding;            // a message is waiting for the rate limiter
+    FrameType heldType;
+    std::string held;
+    uint64_t holdNs;         // how long until it may go through
+    std::coroutine_handle<> waiter;   // the session, while suspended
+    unsigned wakeOn;         // WAKE_* events the session waits for
+    unsigned wakeFired;      // WAKE_* events the session has not seen yet
+    bool resumeQueued;
+    SessionTask session;     // last, so it is destroyed while the state above still exists
+    
+    static void* operator new(size_t size) { return SlabPool::allocate(size); }
+    static void operator delete(void* memory, size_t size) { SlabPool::free(memory, size); }
+    
+    Connection(SOCKET s, Shard* owner) : socket(s), shard(owner), userInfoReceived(false), writable(true), writeInterest(false), closing(false), flushScheduled(false), flushHeld(false), batching(false), burstMessages(0), burstStartNs(0), outQueueBytes(0), outOffset(0), lastReceiveNs(0), timer(this), pingSentNs(0), peerAddress(0), rateNoticeSent(false), holding(false), heldType(FrameType::Chat), holdNs(0), waiter(nullptr), wakeOn(0), wakeFired(0), resumeQueued(false) {}
+};
+
+// Events a session waits for, signalled by the reactor
+const unsigned WAKE_READABLE = 1;
+const unsigned WAKE_TIMER = 2;     // the connection's timer fired
+const unsigned WAKE_DRAINED = 4;   // the outbound queue is back under SESSION_RESUME_BYTES
+
+// A session stops reading while its outbound queue holds more than this,
+// and carries on once it is down to the lower mark
+const size_t SESSION_PAUSE_BYTES = 256 * 1024;
+const size_t SESSION_RESUME_BYTES = 64 * 1024;
+
+// co_await SessionWait{conn, events} suspends the session until one of
+// `events` happens and returns the ones that did. Events that happen while
+// the session is busy are remembered for its next wait, because
+// edge-triggered readiness is reported only once.
+struct SessionWait {
+    Connection& conn;
+    unsigned events;
+    
+    bool await_ready() const { return (conn.wakeFired & events) != 0; }
+    
+    void await_suspend(std::coroutine_handle<> handle) {
+        conn.waiter = handle;
+        conn.wakeOn = events;
+    }
+    
+    unsigned await_resume() {
+        unsigned fired = conn.wakeFired & events;
+        conn.wakeFired &= ~fired;
+        conn.wakeOn = 0;
+        return fired;
+    }
+};
+
+// Work posted to a shard by other threads
+// Shards still queueing one room message to their members. Whichever
+// finishes last records how long the whole fan-out took.
+struct FanoutCompletion {
+    std::atomic<size_t> pending;
+    uint64_t receivedNs;
+    
+    FanoutCompletion(size_t parts, uint64_t ns) : pending(parts), receivedNs(ns) {}
+};
+
+struct ShardMessage {
+    enum Kind { Broadcast, Adopt, Direct };
+    
+    Kind kind;
+    SOCKET socket;        // sender to skip for Broadcast, accepted socket for Adopt, recipient for Direct
+    NameId recipient;     // Direct: username the socket must still belong to
+    std::shared_ptr<Room> room;
+    std::shared_ptr<const MemberSnapshot> members;
+    SharedBuffer message;  // encodeSharedMessage() output, shared by all shards
+    uint64_t seq;          // Broadcast: the message's room sequence id
+    uint64_t receivedNs;   // when the sender's bytes were read; 0 for server notices
+    std::shared_ptr<FanoutCompletion> completion;   // Broadcast: null when no completion is timed
+    
+    ShardMessage() : kind(Broadcast), socket(INVALID_SOCKET), recipient(0), seq(0), receivedNs(0) {}
+};
+
+// Room messages being queued to one shard's members. A large partition
+// is worked through a slice at a time between rounds of socket I/O.
+// Messages for the same room that arrive before the job has started join
+// it, so each member gets the whole batch in one visit and one write.
+struct FanoutJob {
+    struct Message {
+        SharedBuffer encoded;      // encodeSharedMessage() output
+        SharedBuffer tagged;       // copy tagged with the room, encoded when first needed
+        uint64_t seq;
+        SOCKET sender;             // gets no copy
+        uint64_t receivedNs;       // 0 for server notices
+        std::shared_ptr<FanoutCompletion> completion;   // null when no completion is timed
+    };
+    
+    std::shared_ptr<Room> room;
+    std::shared_ptr<const MemberSnapshot> members;   // the newest of its messages' snapshots
+    std::vector<Message, SlabAllocator<Message>> messages;   // in room order
+    size_t next = 0;           // next index into this shard's members
+};
+
+// One reactor: a thread with its own poller, listening socket and
+// connections. A connection is only ever touched by the shard that owns it;
+// other shards reach it by posting to the lock-free inbox.
+struct Shard {
+    size_t index;
+    Poller poller;
+    WakeupChannel wakeup;
+    MpscQueue<ShardMessage> inbox;
+    SOCKET listenSocket;
+    std::unordered_map<SOCKET, std::unique_ptr<Connection>> connections;
+    std::vector<Connection*> pendingClose;
+    std::vector<Connection*> pendingFlush;
+    std::vector<Connection*> flushBatch;   // pendingFlush being worked through
+    std::vector<SOCKET> heldFlush;         // batching connections to flush when the window closes
+    uint64_t heldFlushDueNs;               // when it closes
+    uint64_t roundNs;                      // monotonic time the current event loop round started
+    std::vector<Connection*> pendingResume;   // sessions whose wait is over
+    std::vector<Connection*> resumeBatch;
+    size_t activeReplays;
+    std::deque<SOCKET> replayWaiting;   // connections waiting for a replay slot, FIFO
+    std::deque<FanoutJob> fanout;       // room messages still being queued to members, oldest first
+    TimerWheel timers;                  // connection deadlines
+    TokenBucket acceptBucket;
+    TimerWheel::Timer acceptTimer;      // resumes accepting after a rate-limit pause
+    SlabPool* slab;                     // this reactor's allocations
+    std::string lineBuffer;             // message being composed; keeps its capacity
+    std::vector<UserDirectory::Endpoint> directTargets;   // /msg recipients being worked through
+    char readBuffer[8192];              // every session reads through this one buffer
+    std::thread thread;
+    ShardMetrics metrics;
+    
+    explicit Shard(size_t i)
+        : index(i), listenSocket(INVALID_SOCKET), heldFlushDueNs(0), roundNs(ClockService::monotonicNanos()),
+          activeReplays(0),
+          timers(TIMER_WHEEL_SLOTS, TIMER_TICK_MS * 1000000ULL, ClockService::monotonicNanos()), acceptTimer(this),
+          slab(SlabPool::create()) {}
+};
+
+// What to do when a client's outbound queue is full
+enum class SlowConsumerPolicy {
+    DropOldest,       // discard the oldest queued messages
+    DropConnection,   // disconnect the client
+    Coalesce          // collapse the backlog into one "messages skipped" notice
+};
+
+// What to do with traffic over a rate limit
+enum class RatePolicy {
+    Shed,    // drop it (messages: tell the sender once)
+    Delay    // hold it back and stop reading, so TCP pushes back on the sender
+};
+
+struct ServerConfig {
+    unsigned short port = 8080;
+    size_t shards = 0;  // 0 = one per hardware thread
+    size_t queueLimit = 1024;              // messages per connection
+    size_t queueBytes = 1024 * 1024;       // bytes per connection
+    SlowConsumerPolicy slowConsumerPolicy = SlowConsumerPolicy::DropOldest;
+    int listenBacklog = SOMAXCONN;         // pending connections the kernel may hold
+    size_t maxReplays = 64;                // concurrent history replays per shard
+    size_t fanoutSlice = 512;              // recipients a shard queues to between rounds of socket I/O
+    unsigned flushWindowMs = 5;            // longest a busy connection's output waits to be batched; 0 = never
+    size_t flushBytes = 16 * 1024;         // queued output a batching connection writes without waiting
+    size_t flushBusy = 4;                  // messages per flush window that make a connection batch
+    unsigned handshakeTimeoutSec = 10;     // to send USERNAME|ROOM; 0 = no limit
+    unsigned idleTimeoutSec = 60;          // silence before a keepalive ping; 0 = never
+    unsigned pingTimeoutSec = 20;          // to answer the ping before being closed
+    RateLimit connectionRate = RateLimit(100, 200);   // messages per client
+    RateLimit roomRate;                    // chat messages per room; off by default
+    RateLimit addressRate;                 // messages per source IP; off by default
+    RateLimit acceptRate;                  // new connections per shard; off by default
+    RatePolicy ratePolicy = RatePolicy::Delay;
+    size_t historyMessages = 100;          // per room unless overridden below
+    size_t historyBytes = 64 * 1024;       // history slab per room
+    std::map<std::string, size_t> roomHistoryMessages;
+    size_t roomMemory = 64 * 1024 * 1024;  // resident rooms, before idle ones are evicted
+    unsigned short metricsPort = 0;        // Prometheus endpoint on 127.0.0.1; 0 = off
+    LogLevel logLevel = LogLevel::Info;
+    std::string logFile;                   // empty = stdout
+    uint32_t chatLogSample = 1;            // log one chat message in N; 0 = none
+    size_t offlineMessages = 100;          // direct messages kept per offline user
+    size_t offlineBytes = 4 * 1024 * 1024; // all offline direct messages together
+    std::string dataDir;                   // durable room history; empty = memory only
+    RoomLogOptions roomLog;
+};
+
+struct SlowConsumerStats {
+    std::atomic<uint64_t> droppedMessages{0};
+    std::atomic<uint64_t> disconnects{0};
+    std::atomic<uint64_t> coalesced{0};
+};
+
+static std::atomic<bool> shutdownRequested(false);
+
+const size_t HISTORY_CHUNK_RECORDS = 32;      // records queued per replay step
+const size_t HISTORY_QUEUE_LOW_WATER = 64;    // refill a replay below this queue depth
+const size_t HISTORY_MAX_LIMIT = 10000;       // most records one /history may ask for
+
+const uint64_t OUTPUT_RATE_PERIOD_NS = 100000000ULL;   // a connection's output rate is judged per 100 ms
+
+class ChatServer {
+private:
+    ServerConfig config;
+    uint32_t busyOutput;                   // output per OUTPUT_RATE_PERIOD_NS that makes a connection batch
+    NameTable names;                       // outlives the connections holding names
+    std::vector<std::unique_ptr<Shard>> shards;
+    bool reusePortSharding;
+    size_t nextAdoptShard;
+    ClientRegistry clients;
+    UserDirectory users;                   // routes /msg
+    std::map<std::string, std::shared_ptr<Room>> rooms;
+    std::mutex roomsMutex;                 // guards the directory only
+    std::list<Room*> idleRooms;            // least recently used first; guarded by roomsMutex
+    std::atomic<size_t> roomBytes;         // charged by resident rooms against config.roomMemory
+    uint64_t roomsEvicted;                 // guarded by roomsMutex
+    uint64_t roomsLoaded;                  // rooms whose history was read back from disk; likewise
+    std::atomic<uint64_t> roomsVersion;    // bumped by every room creation and eviction
+    std::atomic<uint64_t> membersVersion;  // bumped by every join and leave
+    std::mutex roomsReplyMutex;            // guards the three below
+    SharedBuffer roomsReply;               // encoded /rooms reply
+    uint64_t roomsReplyVersion;            // roomsVersion it was rendered at
+    uint64_t roomsReplyMembers;            // membersVersion likewise
+    uint64_t roomsReplyNs;                 // when it was rendered
+    std::atomic<bool> running;
+    bool initialized;
+    SlowConsumerStats slowConsumerStats;
+    ClockService clockService;
+    SOCKET metricsSocket;
+    std::thread metricsThread;
+    std::unique_ptr<RoomLogStore> roomLogs;
+    AddressRateTable addressRates;
+    
+    // Start a message line with "[HH:MM:SS] " in the shard's line buffer.
+    // The buffer keeps its capacity, so composing a message allocates
+    // nothing once it has grown to the longest line seen.
+    std::string& beginLine(Shard& shard) {
+        std::string& line = shard.lineBuffer;
+        line.clear();
+        line += '[';
+        clockService.appendWallClock(line);
+        line += "] ";
+        return line;
+    }
+    
+    void scheduleClose(Connection& conn) {
+        if (!conn.closing) {
+            conn.closing = true;
+            conn.shard->pendingClose.push_back(&conn);
+        }
+    }
+    
+    // Every change to an outbound queue goes through these two so the
+    // shard's queue-depth gauges stay exact
+    void pushOutput(Connection& conn, SharedBuffer data) {
+        conn.shard->metrics.queuedMessages.add();
+        conn.shard->metrics.queuedBytes.add(data.size());
+        conn.outQueueBytes += data.size();
+        conn.outQueue.push_back(std::move(data));
+    }
+    
+    void eraseOutput(Connection& conn, size_t first, size_t last) {
+        size_t bytes = 0;
+        for (size_t i = first; i < last; ++i) {
+            bytes += conn.outQueue[i].size();
+        }
+        conn.shard->metrics.queuedMessages.sub(last - first);
+        conn.shard->metrics.queuedBytes.sub(bytes);
+        conn.outQueueBytes -= bytes;
+        conn.outQueue.erase(conn.outQueue.begin() + first, conn.outQueue.begin() + last);
+    }
+    
+    // Drop whatever the kernel accepted from the front of the queue
+    void consumeOutput(Connection& conn, size_t sent) {
+        while (sent > 0) {
+            size_t remaining = conn.outQueue.front().size() - conn.outOffset;
+            if (sent < remaining) {
+                conn.outOffset += sent;
+                return;
+            }
+            sent -= remaining;
+            eraseOutput(conn, 0, 1);
+            conn.outOffset = 0;
+        }
+    }
+    
+    // Write as much queued output as the socket accepts without blocking,
+    // gathering up to MAX_IO_SLICES queued messages into each system call.
+    // A write that leaves more queued behind it is sent corked, so the
+    // kernel does not push a short segment between the two.
+    void flushConnection(Connection& conn) {
+        IoSlice slices[MAX_IO_SLICES];
+        
+        while (!conn.outQueue.empty()) {
+            size_t count = 0;
+            size_t requested = 0;
+            size_t offset = conn.outOffset;
+            for (auto it = conn.outQueue.begin(); it != conn.outQueue.end() && count < MAX_IO_SLICES; ++it) {
+                slices[count].data = it->data() + offset;
+                slices[count].length = it->size() - offset;
+                requested += slices[count].length;
+                ++count;
+                offset = 0;
+            }
+            
+            int sent = sendBuffers(conn.socket, slices, count, count < conn.outQueue.size());
+            conn.shard->metrics.outputWrites.add();
+            if (sent > 0) {
+                conn.shard->metrics.bytesSent.add(sent);
+                consumeOutput(conn, sent);
+                if ((size_t)sent < requested) {
+                    // Short write: the socket buffer is full, wait for writability
+                    break;
+                }
+                continue;
+            }
+            int error = WSAGetLastError();
+            if (sent < 0 && error == WSAEINTR) {
+                continue;
+            }
+            if (sent < 0 && socketWouldBlock(error)) {
+                conn.writable = false;
+                if (!conn.writeInterest) {
+                    conn.writeInterest = true;
+                    conn.shard->poller.setWriteInterest(conn.socket, &conn, true);
+                }
+                return;
+            }
+            scheduleClose(conn);
+            return;
+        }
+        
+        if (conn.outQueue.empty() && conn.history && conn.history->admitted) {
+            // Drained with the socket still writable: queue the next part of
+            // the replay, which schedules another flush
+            pumpHistory(conn);
+            return;
+        }
+        
+        if (!conn.outQueue.empty()) {
+            conn.writable = false;
+            if (!conn.writeInterest) {
+                conn.writeInterest = true;
+                conn.shard->poller.setWriteInterest(conn.socket, &conn, true);
+            }
+        }
+        else if (conn.writeInterest) {
+            conn.writeInterest = false;
+            conn.shard->poller.setWriteInterest(conn.socket, &conn, false);
+        }
+        if ((conn.wakeOn & WAKE_DRAINED) != 0 && conn.outQueueBytes <= SESSION_RESUME_BYTES) {
+            wakeSession(conn, WAKE_DRAINED);
+        }
+    }
+    
+    void scheduleFlush(Connection& conn) {
+        if (!conn.flushScheduled) {
+            conn.flushScheduled = true;
+            conn.shard->pendingFlush.push_back(&conn);
+        }
+    }
+    
+    static uint32_t busyOutputFor(const ServerConfig& cfg) {
+        if (cfg.flushWindowMs == 0) {
+            return 0;
+        }
+        uint64_t perPeriod = cfg.flushBusy * OUTPUT_RATE_PERIOD_NS / (cfg.flushWindowMs * 1000000ULL);
+        return (uint32_t)std::clamp<uint64_t>(perPeriod, 1, UINT32_MAX);
+    }
+    
+    void setBatching(Connection& conn, bool batching) {
+        if (conn.batching != batching) {
+            conn.batching = batching;
+            if (batching) {
+                conn.shard->metrics.batchingConnections.add();
+            }
+            else {
+                conn.shard->metrics.batchingConnections.sub();
+            }
+        }
+    }
+    
+    // Adaptive flushing. A connection is judged by how much output it was
+    // queued over the last OUTPUT_RATE_PERIOD_NS: below flushBusy messages
+    // per flush window every message is written at once, for the lowest
+    // latency; above it the connection batches, and its flushes wait up to
+    // the window so that one write carries many messages. It starts
+    // batching as soon as a period gets busy and stops after a quiet one.
+    void countOutput(Connection& conn) {
+        if (config.flushWindowMs == 0) {
+            return;
+        }
+        uint64_t nowNs = conn.shard->roundNs;
+        if (nowNs - conn.burstStartNs >= OUTPUT_RATE_PERIOD_NS) {
+            bool lastPeriodBusy = nowNs - conn.burstStartNs < 2 * OUTPUT_RATE_PERIOD_NS &&
+                                  conn.burstMessages >= busyOutput;
+            setBatching(conn, lastPeriodBusy);
+            conn.burstStartNs = nowNs;
+            conn.burstMessages = 0;
+        }
+        if (++conn.burstMessages >= busyOutput) {
+            setBatching(conn, true);
+        }
+    }
+    
+    // Put a batching connection's flush off until the shard's flush window
+    // closes. The window opens with the first held flush, so no output
+    // waits longer than flushWindowMs.
+    void holdFlush(Connection& conn) {
+        Shard& shard = *conn.shard;
+        if (conn.flushHeld) {
+            return;
+        }
+        if (shard.heldFlush.empty()) {
+            shard.heldFlushDueNs = shard.roundNs + config.flushWindowMs * 1000000ULL;
+        }
+        conn.flushHeld = true;
+        shard.heldFlush.push_back(conn.socket);
+        shard.metrics.flushesHeld.add();
+    }
+    
+    // Held flushes name sockets rather than connections, since a connection
+    // may close while it waits
+    void flushHeldConnections(Shard& shard) {
+        if (shard.heldFlush.empty() || shard.roundNs < shard.heldFlushDueNs) {
+            return;
+        }
+        for (SOCKET socket : shard.heldFlush) {
+            auto it = shard.connections.find(socket);
+            if (it == shard.connections.end()) {
+                continue;
+            }
+            Connection& conn = *it->second;
+            conn.flushHeld = false;
+            if (!conn.closing && conn.writable) {
+                flushConnection(conn);
+            }
+        }
+        shard.heldFlush.clear();
+    }
+    
+    bool queueFull(const Connection& conn, size_t incoming) const {
+        return conn.outQueue.size() >= config.queueLimit ||
+               conn.outQueueBytes + incoming > config.queueBytes;
+    }
+    
+    // Make room for `incoming` bytes on a full queue. Returns false if the
+    // new message must not be queued. A partially written front message is
+    // never touched, otherwise the stream would be corrupted.
+    bool applySlowConsumerPolicy(Connection& conn, size_t incoming) {
+        size_t keep = conn.outOffset > 0 ? 1 : 0;
+        
+        switch (config.slowConsumerPolicy) {
+            case SlowConsumerPolicy::DropConnection:
+                slowConsumerStats.disconnects.fetch_add(1, std::memory_order_relaxed);
+                logMessage(LogLevel::Warn, "Disconnecting slow client ", conn.username.str());
+                scheduleClose(conn);
+                return false;
+            
+            case SlowConsumerPolicy::DropOldest:
+                while (conn.outQueue.size() > keep && queueFull(conn, incoming)) {
+                    eraseOutput(conn, keep, keep + 1);
+                    slowConsumerStats.droppedMessages.fetch_add(1, std::memory_order_relaxed);
+                }
+                break;
+            
+            case SlowConsumerPolicy::Coalesce: {
+                size_t skipped = conn.outQueue.size() - keep;
+                eraseOutput(conn, keep, conn.outQueue.size());
+                if (skipped > 0) {
+                    pushOutput(conn, encodeFor(conn, FrameType::System,
+                        "*** " + std::to_string(skipped) + " messages skipped: connection too slow ***"));
+                    slowConsumerStats.droppedMessages.fetch_add(skipped, std::memory_order_relaxed);
+                    slowConsumerStats.coalesced.fetch_add(1, std::memory_order_relaxed);
+                }
+                break;
+            }
+        }
+        
+        if (queueFull(conn, incoming)) {
+            slowConsumerStats.droppedMessages.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+    
+    // Queue output for the shard to flush at the end of the current batch
+    void queueSend(Connection& conn, SharedBuffer data) {
+        if (conn.closing) {
+            return;
+        }
+        if (queueFull(conn, data.size()) && !applySlowConsumerPolicy(conn, data.size())) {
+            return;
+        }
+        conn.shard->metrics.messagesQueued.add();
+        pushOutput(conn, std::move(data));
+        countOutput(conn);
+        scheduleFlush(conn);
+    }
+    
+    bool isFramed(const Connection& conn) const {
+        return conn.parser.getMode() == FrameParser::Framed;
+    }
+    
+    // Encode a message in whichever wire mode the client negotiated
+    SharedBuffer encodeFor(const Connection& conn, FrameType type, const std::string& message) {
+        return wireView(encodeSharedMessage(type, message), isFramed(conn));
+    }
+    
+    void sendFrame(Connection& conn, FrameType type, const std::string& message) {
+        queueSend(conn, encodeFor(conn, type, message));
+    }
+    
+    // Chat, /list and /history apply to the room joined last
+    static const std::shared_ptr<Room>& activeRoom(const Connection& conn) {
+        return conn.rooms.back().room;
+    }
+    
+    // Such connections get every room message tagged with its room
+    static bool followsSeveralRooms(const Connection& conn) {
+        return conn.rooms.size() > 1;
+    }
+    
+    // Index of the room in conn.rooms, or conn.rooms.size() if not joined
+    static size_t findSubscription(const Connection& conn, std::string_view roomName) {
+        size_t i = 0;
+        while (i < conn.rooms.size() && conn.rooms[i].name.str() != roomName) {
+            ++i;
+        }
+        return i;
+    }
+    
+    // Null if not joined
+    static const RoomSubscription* subscriptionTo(const Connection& conn, const Room& room) {
+        for (const RoomSubscription& joined : conn.rooms) {
+            if (joined.room.get() == &room) {
+                return &joined;
+            }
+        }
+        return nullptr;
+    }
+    
+    // A notice about one room, tagged like the room's messages
+    void sendRoomFrame(Connection& conn, const Room& room, FrameType type, const std::string& message) {
+        if (followsSeveralRooms(conn)) {
+            queueSend(conn, wireView(encodeSharedMessage(type, message, 0, room.name), isFramed(conn)));
+        }
+        else {
+            sendFrame(conn, type, message);
+        }
+    }
+    
+    // Look a room up, creating it if it is not resident (loading its
+    // history back from disk if it has a log), and keep it resident until
+    // the matching releaseRoom(). The directory lock is only held for the
+    // lookup and the bookkeeping.
+    std::shared_ptr<Room> acquireRoom(const std::string& roomName) {
+        std::vector<std::shared_ptr<Room>> evicted;   // destroyed after the lock is released
+        TimedLockGuard lock(roomsMutex, LockClass::RoomDirectory);
+        auto it = rooms.find(roomName);
+        if (it == rooms.end()) {
+            size_t historyMessages = config.historyMessages;
+            auto overrideIt = config.roomHistoryMessages.find(roomName);
+            if (overrideIt != config.roomHistoryMessages.end()) {
+                historyMessages = overrideIt->second;
+            }
+            auto room = std::make_shared<Room>(roomName, historyMessages, config.historyBytes, shards.size());
+            if (roomLogs) {
+                openRoomLog(roomName, *room);
+                if (room->history.size() > 0) {
+                    ++roomsLoaded;
+                }
+            }
+            room->chargedBytes = room->chargeableBytes();
+            roomBytes.fetch_add(room->chargedBytes, std::memory_order_relaxed);
+            it = rooms.emplace(roomName, std::move(room)).first;
+            roomsVersion.fetch_add(1, std::memory_order_release);
+        }
+        
+        Room& room = *it->second;
+        if (room.subscribers++ == 0 && room.idle) {
+            idleRooms.erase(room.idleEntry);
+            room.idle = false;
+        }
+        std::shared_ptr<Room> acquired = it->second;
+        evictIdleRooms(evicted);
+        return acquired;
+    }
+    
+    // Once nobody is subscribed the room goes idle. It stays resident, and
+    // listed by /rooms, until the memory budget needs it gone.
+    void releaseRoom(Room& room) {
+        std::vector<std::shared_ptr<Room>> evicted;
+        TimedLockGuard lock(roomsMutex, LockClass::RoomDirectory);
+        if (--room.subscribers == 0) {
+            room.idle = true;
+            room.idleEntry = idleRooms.insert(idleRooms.end(), &room);
+            evictIdleRooms(evicted);
+        }
+    }
+    
+    // Evict idle rooms, least recently used first, until the resident ones
+    // fit the budget. A room with a log keeps its history on disk and the
+    // next join loads it again; one without is dropped. The log is handed
+    // to the RoomLogStore's flusher thread to write out, sync and close, so
+    // no file I/O happens here or when `evicted` is released. Whatever still
+    // holds an evicted room, such as a replay in progress, keeps it alive
+    // until done. Caller holds roomsMutex and releases `evicted` after it.
+    void evictIdleRooms(std::vector<std::shared_ptr<Room>>& evicted) {
+        while (!idleRooms.empty() && roomBytes.load(std::memory_order_relaxed) > config.roomMemory) {
+            Room& room = *idleRooms.front();
+            idleRooms.pop_front();
+            room.idle = false;
+            {
+                TimedLockGuard roomLock(room.roomMutex, LockClass::RoomHistory);
+                roomBytes.fetch_sub(room.chargedBytes, std::memory_order_relaxed);
+            }
+            if (room.log) {
+                roomLogs->closeRoom(room.log);
+            }
+            auto it = rooms.find(room.name);
+            evicted.push_back(std::move(it->second));
+            rooms.erase(it);
+            ++roomsEvicted;
+            roomsVersion.fetch_add(1, std::memory_order_release);
+            logMessage(LogLevel::Debug, "Evicted idle room ", evicted.back()->name);
+        }
+    }
+    
+    // Attach the room's on-disk log and seed the in-memory ring with its
+    // newest messages, read straight from the mapped tail segment
+    void openRoomLog(const std::string& roomName, Room& room) {
+        MessageHistory& history = room.history;
+        room.log = roomLogs->openRoom(roomName, history.capacity(), [&history](uint64_t seq, std::string_view message) {
+            history.resetSequence(seq);
+            history.append(message);
+        });
+        if (!room.log) {
+            logMessage(LogLevel::Error, "Cannot open history log for room ", roomName);
+            return;
+        }
+        history.resetSequence(room.log->nextSequence());
+    }
+    
+    void addToRoom(Room& room, Connection& conn) {
+        TimedLockGuard lock(room.membersMutex, LockClass::RoomMembers);
+        auto updated = std::make_shared<MemberSnapshot>(*room.members);
+        updated->byShard[conn.shard->index].push_back(conn.socket);
+        ++updated->total;
+        ++updated->version;
+        std::atomic_store(&room.members, std::shared_ptr<const MemberSnapshot>(std::move(updated)));
+        room.listReply = SharedBuffer();
+        membersVersion.fetch_add(1, std::memory_order_release);
+    }
+    
+    void removeFromRoom(Room& room, Connection& conn) {
+        TimedLockGuard lock(room.membersMutex, LockClass::RoomMembers);
+        auto updated = std::make_shared<MemberSnapshot>(*room.members);
+        auto& shardClients = updated->byShard[conn.shard->index];
+        auto it = std::find(shardClients.begin(), shardClients.end(), conn.socket);
+        if (it == shardClients.end()) {
+            return;
+        }
+        shardClients.erase(it);
+        --updated->total;
+        ++updated->version;
+        std::atomic_store(&room.members, std::shared_ptr<const MemberSnapshot>(std::move(updated)));
+        room.listReply = SharedBuffer();
+        membersVersion.fetch_add(1, std::memory_order_release);
+    }
+    
+    // Returns the message's sequence id
+    uint64_t addMessageToRoom(Room& room, const std::string& message) {
+        uint64_t nowNs = ClockService::monotonicNanos();
+        TimedLockGuard lock(room.roomMutex, LockClass::RoomHistory);
+        uint64_t seq = room.history.append(message);
+        room.countMessage(nowNs);
+        size_t charge = room.chargeableBytes();
+        if (charge != room.chargedBytes) {
+            roomBytes.fetch_add(charge - room.chargedBytes, std::memory_order_relaxed);
+            room.chargedBytes = charge;
+        }
+        if (room.log) {
+            // Sequence numbers come from the ring, so appends reach the log in order
+            roomLogs->appended(*room.log, room.log->append(seq, message));
+        }
+        return seq;
+    }
+    
+    // Queue the job's messages to up to `limit` more of this shard's members
+    // and return how many were gone through. No lock is needed because the
+    // snapshot is immutable. Members that follow several rooms share one
+    // tagged copy of each message, encoded the first time this shard needs
+    // it. The snapshot may be newer or older than a message, so each is
+    // checked against the connection's own subscription, which only this
+    // shard touches: someone who has left gets nothing, and someone who
+    // joined after a message got it in their history replay instead.
+    size_t deliverSlice(Shard& shard, FanoutJob& job, size_t limit) {
+        const std::vector<SOCKET>& sockets = job.members->byShard[shard.index];
+        const Room& room = *job.room;
+        size_t begin = job.next;
+        size_t end = std::min(sockets.size(), begin + limit);
+        for (; job.next < end; ++job.next) {
+            SOCKET client = sockets[job.next];
+            if (client == INVALID_SOCKET) {
+                continue;
+            }
+            auto it = shard.connections.find(client);
+            if (it == shard.connections.end()) {
+                continue;
+            }
+            Connection& conn = *it->second;
+            const RoomSubscription* joined = subscriptionTo(conn, room);
+            if (joined == nullptr) {
+                continue;
+            }
+            bool tagged = followsSeveralRooms(conn);
+            for (FanoutJob::Message& message : job.messages) {
+                if (client == message.sender || message.seq <= joined->joinedSeq) {
+                    continue;
+                }
+                if (!tagged) {
+                    queueSend(conn, wireView(message.encoded, isFramed(conn)));
+                    continue;
+                }
+                if (message.tagged.empty()) {
+                    message.tagged = tagSharedMessage(message.encoded, room.name);
+                }
+                queueSend(conn, wireView(message.tagged, isFramed(conn)));
+            }
+        }
+        return end - begin;
+    }
+    
+    // A shard's part of a room message is queued at once if it is small.
+    // A larger one waits in the shard's fan-out queue, and so does anything
+    // arriving while that queue is not empty, so every member still sees a
+    // room's messages in order. runShard() works through the queue a slice
+    // at a time, so neither the sender's session nor the shard's other
+    // connections wait for a big room to be served.
+    void startFanout(Shard& shard, const std::shared_ptr<Room>& room, std::shared_ptr<const MemberSnapshot> members,
+                     FanoutJob::Message message) {
+        if (!shard.fanout.empty()) {
+            FanoutJob& last = shard.fanout.back();
+            if (last.next == 0 && last.room == room) {
+                if (members->version > last.members->version) {
+                    last.members = std::move(members);
+                }
+                last.messages.push_back(std::move(message));
+                shard.metrics.fanoutDeferred.add();
+                return;
+            }
+        }
+        
+        FanoutJob job;
+        job.room = room;
+        job.members = std::move(members);
+        job.messages.push_back(std::move(message));
+        if (shard.fanout.empty() && job.members->byShard[shard.index].size() <= config.fanoutSlice) {
+            deliverSlice(shard, job, config.fanoutSlice);
+            finishFanout(shard, job);
+            return;
+        }
+        shard.fanout.push_back(std::move(job));
+        shard.metrics.fanoutDeferred.add();
+    }
+    
+    // Serve up to fanoutSlice more members from the fan-out queue. The
+    // budget counts members, not messages: each visit ends in one write
+    // however large the batch.
+    void continueFanout(Shard& shard) {
+        size_t budget = config.fanoutSlice;
+        while (!shard.fanout.empty() && budget > 0) {
+            FanoutJob& job = shard.fanout.front();
+            budget -= deliverSlice(shard, job, budget);
+            if (job.next < job.members->byShard[shard.index].size()) {
+                break;
+            }
+            finishFanout(shard, job);
+            shard.fanout.pop_front();
+        }
+    }
+    
+    void finishFanout(Shard& shard, FanoutJob& job) {
+        uint64_t nowNs = ClockService::monotonicNanos();
+        for (const FanoutJob::Message& message : job.messages) {
+            if (message.receivedNs == 0) {
+                continue;
+            }
+            shard.metrics.fanoutLatency.record(nowNs - message.receivedNs);
+            if (!message.completion || message.completion->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                shard.metrics.fanoutCompletion.record(nowNs - message.receivedNs);
+            }
+        }
+    }
+    
+    // The message is encoded once and shared by every recipient. Members on
+    // the calling shard are queued here; every other shard with members in
+    // the room gets a single inbox entry carrying the same member snapshot,
+    // so the shards serve their own members in parallel.
+    void sendMessageToRoom(Shard& shard, const std::shared_ptr<Room>& room, FrameType type, const std::string& message,
+                           uint64_t seq, SOCKET sender = INVALID_SOCKET, uint64_t receivedNs = 0) {
+        SharedBuffer encoded = encodeSharedMessage(type, message, seq);
+        std::shared_ptr<const MemberSnapshot> members = room->memberSnapshot();
+        
+        std::shared_ptr<FanoutCompletion> completion;
+        if (receivedNs != 0) {
+            size_t parts = 1;
+            for (size_t i = 0; i < members->byShard.size(); ++i) {
+                if (i != shard.index && !members->byShard[i].empty()) {
+                    ++parts;
+                }
+            }
+            if (parts > 1) {
+                completion = std::allocate_shared<FanoutCompletion>(SlabAllocator<FanoutCompletion>(), parts, receivedNs);
+            }
+        }
+        
+        for (size_t i = 0; i < members->byShard.size(); ++i) {
+            if (i == shard.index || members->byShard[i].empty()) {
+                continue;
+            }
+            ShardMessage post;
+            post.kind = ShardMessage::Broadcast;
+            post.socket = sender;
+            post.room = room;
+            post.members = members;
+            post.message = encoded;
+            post.seq = seq;
+            post.receivedNs = receivedNs;
+            post.completion = completion;
+            shards[i]->inbox.push(std::move(post));
+            shards[i]->wakeup.notify();
+        }
+        
+        startFanout(shard, room, std::move(members),
+                    FanoutJob::Message{std::move(encoded), SharedBuffer(), seq, sender, receivedNs, std::move(completion)});
+    }
+    
+    // Replay the room's messages after `sinceSeq`, at most `limit` of them.
+    // With no `sinceSeq` (0) the newest `limit` messages are replayed.
+    // Each message is its own sequenced History frame, queued in chunks by
+    // pumpHistory(); messages newer than the replay arrive live meanwhile.
+    // A replay asked for while another is streaming waits behind it.
+    //
+    // A `sinceSeq` past the room's last message means the client numbered
+    // an earlier incarnation of the room. It gets a Reset frame with the
+    // room's next id at once, ahead of any live message, and then the
+    // newest messages as if it had not asked to resume.
+    void sendMessageHistory(Connection& conn, const std::shared_ptr<Room>& room, uint64_t sinceSeq, size_t limit) {
+        uint64_t lastSeq;
+        uint64_t firstSeq;
+        {
+            TimedLockGuard lock(room->roomMutex, LockClass::RoomHistory);
+            lastSeq = room->history.nextSequence() - 1;
+            firstSeq = room->history.firstSequence();
+        }
+        if (sinceSeq > lastSeq) {
+            std::string notice = "*** History of '" + room->name + "' starts over: you asked for messages after #" +
+                                 std::to_string(sinceSeq) + ", the room's last is #" + std::to_string(lastSeq) + " ***";
+            std::string_view tag = followsSeveralRooms(conn) ? std::string_view(room->name) : std::string_view();
+            queueSend(conn, wireView(encodeSharedMessage(FrameType::Reset, notice, lastSeq + 1, tag), isFramed(conn)));
+            sinceSeq = 0;
+            limit = std::min(limit, room->history.capacity());
+        }
+        if (sinceSeq == 0) {
+            // Only the log reaches further back than the ring
+            uint64_t oldest = room->log ? 1 : firstSeq;
+            sinceSeq = lastSeq - std::min<uint64_t>(limit, lastSeq - std::min(oldest - 1, lastSeq));
+        }
+        
+        auto cursor = std::make_unique<HistoryCursor>();
+        cursor->room = room;
+        cursor->nextSeq = sinceSeq + 1;
+        cursor->lastSeq = lastSeq;
+        cursor->remaining = limit;
+        cursor->admitted = false;
+        if (conn.history) {
+            HistoryCursor* last = conn.history.get();
+            while (last->next) {
+                last = last->next.get();
+            }
+            last->next = std::move(cursor);
+            return;
+        }
+        conn.history = std::move(cursor);
+        sendHistoryHeader(conn);
+        
+        Shard& shard = *conn.shard;
+        if (shard.activeReplays < config.maxReplays) {
+            admitReplay(conn);
+        }
+        else {
+            shard.replayWaiting.push_back(conn.socket);
+            shard.metrics.replaysDeferred.add();
+        }
+    }
+    
+    // Replays are the expensive part of a join. When a reconnect storm
+    // brings thousands of clients back at once, each shard streams at most
+    // maxReplays of them and the rest wait their turn in arrival order,
+    // while accepts and handshakes keep going at full speed.
+    void admitReplay(Connection& conn) {
+        conn.history->admitted = true;
+        ++conn.shard->activeReplays;
+        conn.shard->metrics.replaysActive.add();
+        pumpHistory(conn);
+    }
+    
+    void releaseReplay(Shard& shard) {
+        --shard.activeReplays;
+        shard.metrics.replaysActive.sub();
+        while (!shard.replayWaiting.empty() && shard.activeReplays < config.maxReplays) {
+            SOCKET next = shard.replayWaiting.front();
+            shard.replayWaiting.pop_front();
+            auto it = shard.connections.find(next);
+            // The socket may have closed, or been reused by a connection
+            // that was already admitted
+            if (it != shard.connections.end() && it->second->history && !it->second->history->admitted &&
+                !it->second->closing) {
+                admitReplay(*it->second);
+            }
+        }
+    }
+    
+    // Top the queue up with replay records until it reaches the low-water
+    // mark, finishing the replay once everything requested is queued
+    void pumpHistory(Connection& conn) {
+        while (conn.history && conn.history->admitted && !conn.closing && conn.outQueue.size() < HISTORY_QUEUE_LOW_WATER) {
+            HistoryCursor& cursor = *conn.history;
+            if (cursor.remaining == 0 || cursor.nextSeq > cursor.lastSeq) {
+                finishHistory(conn);
+                continue;
+            }
+            size_t queued = queueHistoryChunk(conn, cursor, std::min(HISTORY_CHUNK_RECORDS, cursor.remaining));
+            cursor.remaining -= queued;
+            conn.shard->metrics.messagesQueued.add(queued);
+        }
+        if (!conn.outQueue.empty()) {
+            scheduleFlush(conn);
+        }
+    }
+    
+    void sendHistoryHeader(Connection& conn) {
+        sendRoomFrame(conn, *conn.history->room, FrameType::System,
+                      followsSeveralRooms(conn) ? "=== Room History ===" : "\n=== Room History ===");
+    }
+    
+    // The next queued replay, if any, inherits the shard slot
+    void finishHistory(Connection& conn) {
+        HistoryCursor& cursor = *conn.history;
+        std::string footer = "=== End History ===";
+        if (cursor.nextSeq <= cursor.lastSeq) {
+            footer = "=== End History: more after #" + std::to_string(cursor.nextSeq - 1) +
+                     ", use /history " + std::to_string(cursor.nextSeq - 1) + " ===";
+        }
+        sendRoomFrame(conn, *cursor.room, FrameType::System, footer);
+        conn.history = std::move(cursor.next);
+        if (conn.history) {
+            conn.history->admitted = true;
+            sendHistoryHeader(conn);
+            return;
+        }
+        releaseReplay(*conn.shard);
+    }
+    
+    // Queue up to `limit` records from cursor.nextSeq on and advance the
+    // cursor. Recent records are copied out of the in-memory ring; older
+    // ones are sent straight from the mapped log segment. Records that are
+    // gone from both are skipped.
+    size_t queueHistoryChunk(Connection& conn, HistoryCursor& cursor, size_t limit) {
+        Room& room = *cursor.room;
+        bool framed = isFramed(conn);
+        std::string_view tag = followsSeveralRooms(conn) ? std::string_view(room.name) : std::string_view();
+        uint64_t firstInMemory;
+        {
+            TimedLockGuard lock(room.roomMutex, LockClass::RoomHistory);
+            firstInMemory = room.history.firstSequence();
+            if (cursor.nextSeq >= firstInMemory) {
+                size_t queued = 0;
+                room.history.forEachSince(cursor.nextSeq - 1, [&](uint64_t seq, std::string_view msg) {
+                    if (seq <= cursor.lastSeq) {
+                        pushOutput(conn, wireView(encodeSharedMessage(FrameType::History, msg, seq, tag), framed));
+                        ++queued;
+                    }
+                }, limit);
+                cursor.nextSeq = queued > 0 ? cursor.nextSeq + queued : cursor.lastSeq + 1;
+                return queued;
+            }
+        }
+        
+        size_t queued = 0;
+        if (room.log) {
+            queued = queueLoggedHistory(conn, cursor, std::min(cursor.lastSeq, firstInMemory - 1), limit);
+        }
+        if (queued == 0) {
+            cursor.nextSeq = firstInMemory;
+        }
+        return queued;
+    }
+    
+    // Zero-copy replay from disk: each payload is queued as a view of the
+    // mapped segment, behind a frame header (or followed by a newline) from
+    // one small per-chunk buffer, which also holds the room tag if needed
+    size_t queueLoggedHistory(Connection& conn, HistoryCursor& cursor, uint64_t lastSeq, size_t limit) {
+        bool framed = isFramed(conn);
+        std::string_view tag = followsSeveralRooms(conn) ? std::string_view(cursor.room->name) : std::string_view();
+        size_t headerSize = tag.empty() ? SEQUENCED_HEADER_SIZE : roomTaggedHeaderSize(1, tag);
+        size_t textTagSize = tag.empty() ? 0 : tag.size() + 3;   // "[ROOM] "
+        SharedBuffer headers = SharedBuffer::allocate(framed ? limit * headerSize : 1 + textTagSize);
+        char* out = headers.writableData();
+        if (!framed) {
+            out[0] = '\n';
+            if (!tag.empty()) {
+                out[1] = '[';
+                memcpy(out + 2, tag.data(), tag.size());
+                out[2 + tag.size()] = ']';
+                out[3 + tag.size()] = ' ';
+            }
+        }
+        SharedBuffer segment;
+        const MappedFile* segmentFile = nullptr;
+        size_t queued = 0;
+        
+        cursor.room->log->read(cursor.nextSeq, lastSeq, limit,
+            [&](uint64_t seq, std::string_view payload, const std::shared_ptr<const MappedFile>& mapped) {
+                if (mapped.get() != segmentFile) {
+                    segmentFile = mapped.get();
+                    segment = SharedBuffer::external(mapped, mapped->data(), mapped->size());
+                }
+                SharedBuffer body = segment.slice(payload.data() - mapped->data(), payload.size());
+                if (framed) {
+                    char* header = out + queued * headerSize;
+                    if (tag.empty()) {
+                        writeSequencedHeader(header, FrameType::History, seq, payload.size());
+                    }
+                    else {
+                        writeRoomTaggedHeader(header, FrameType::History, seq, tag, payload.size());
+                    }
+                    pushOutput(conn, headers.slice(queued * headerSize, headerSize));
+                    pushOutput(conn, std::move(body));
+                }
+                else {
+                    if (textTagSize > 0) {
+                        pushOutput(conn, headers.slice(1, textTagSize));
+                    }
+                    pushOutput(conn, std::move(body));
+                    pushOutput(conn, headers.slice(0, 1));
+                }
+                cursor.nextSeq = seq + 1;
+                ++queued;
+            });
+        return queued;
+    }
+    
+    // The /list reply is rendered from the client registry's room index and
+    // then shared by every request until the next join or leave
+    SharedBuffer listReplyFor(Room& room, NameId roomId) {
+        TimedLockGuard lock(room.membersMutex, LockClass::RoomMembers);
+        if (room.listReply.empty()) {
+            std::vector<std::string> users = clients.usersInRoom(roomId);
+            std::sort(users.begin(), users.end());
+            std::string userList = "\n=== Users in room '" + room.name + "' ===\n";
+            for (const std::string& user : users) {
+                userList += "- ";
+                userList += user;
+                userList += '\n';
+            }
+            userList += "Total: " + std::to_string(users.size()) + " users\n";
+            room.listReply = encodeSharedMessage(FrameType::System, userList);
+        }
+        return room.listReply;
+    }
+    
+    // Likewise for /rooms. The reply is rebuilt at once when a room is
+    // created or evicted. Member counts change with every join and leave
+    // anywhere on the server, so for those it is rebuilt at most once per
+    // timer tick and may show counts up to a tick old.
+    SharedBuffer roomsReplyNow() {
+        uint64_t version = roomsVersion.load(std::memory_order_acquire);
+        uint64_t members = membersVersion.load(std::memory_order_acquire);
+        TimedLockGuard replyLock(roomsReplyMutex, LockClass::RoomDirectory);
+        uint64_t nowNs = 0;
+        bool stale = roomsReply.empty() || roomsReplyVersion != version;
+        if (!stale && roomsReplyMembers != members) {
+            nowNs = ClockService::monotonicNanos();
+            stale = nowNs - roomsReplyNs >= TIMER_TICK_MS * 1000000ULL;
+        }
+        if (stale) {
+            TimedLockGuard lock(roomsMutex, LockClass::RoomDirectory);
+            std::string roomList = "\n=== Available Rooms ===\n";
+            for (const auto& roomPair : rooms) {
+                roomList += "- " + roomPair.first + " (" + std::to_string(roomPair.second->memberCount()) + " users)\n";
+            }
+            roomList += "Total: " + std::to_string(rooms.size()) + " rooms\n";
+            roomsReply = encodeSharedMessage(FrameType::System, roomList);
+            roomsReplyVersion = version;
+            roomsReplyMembers = members;
+            roomsReplyNs = nowNs != 0 ? nowNs : ClockService::monotonicNanos();
+        }
+        return roomsReply;
+    }
+    
+    bool handleCommand(Connection& conn, std::string_view command) {
+        CommandLine words(command);
+        CommandId id = lookupCommand(words.next());
+        
+        if (id == CommandId::List) {
+            queueSend(conn, wireView(listReplyFor(*activeRoom(conn), conn.rooms.back().name.id()), isFramed(conn)));
+            return true;
+        }
+        else if (id == CommandId::Rooms) {
+            queueSend(conn, wireView(roomsReplyNow(), isFramed(conn)));
+            return true;
+        }
+        else if (id == CommandId::History) {
+            // /history [since_seq] [limit]
+            std::string_view sinceArg = words.next();
+            std::string_view limitArg = words.next();
+            uint64_t since = 0;
+            uint64_t limit = config.historyMessages;
+            if ((!sinceArg.empty() && !CommandLine::parseNumber(sinceArg, since)) ||
+                (!limitArg.empty() && (!CommandLine::parseNumber(limitArg, limit) || limit == 0))) {
+                sendFrame(conn, FrameType::Error, "Usage: /history [since_seq] [limit]");
+                return true;
+            }
+            if (conn.history) {
+                sendFrame(conn, FrameType::Error, "A history replay is already in progress");
+                return true;
+            }
+            sendMessageHistory(conn, activeRoom(conn), since, (size_t)std::min<uint64_t>(limit, HISTORY_MAX_LIMIT));
+            return true;
+        }
+        else if (id == CommandId::Join) {
+            // /join ROOM [since_seq]
+            std::string_view roomArg = words.next();
+            std::string_view sinceArg = words.next();
+            uint64_t since = 0;
+            if (roomArg.empty() || roomArg.size() > MAX_ROOM_NAME ||
+                (!sinceArg.empty() && !CommandLine::parseNumber(sinceArg, since))) {
+                sendFrame(conn, FrameType::Error, "Usage: /join ROOM [since_seq]");
+                return true;
+            }
+            std::string roomName(roomArg);
+            size_t index = findSubscription(conn, roomName);
+            if (index < conn.rooms.size()) {
+                // Already joined: just make it the room chat goes to
+                std::rotate(conn.rooms.begin() + index, conn.rooms.begin() + index + 1, conn.rooms.end());
+                sendFrame(conn, FrameType::System, "Now chatting in '" + roomName + "'");
+                return true;
+            }
+            if (conn.rooms.size() >= MAX_ROOMS_PER_CONNECTION) {
+                sendFrame(conn, FrameType::Error,
+                          "You can join at most " + std::to_string(MAX_ROOMS_PER_CONNECTION) + " rooms");
+                return true;
+            }
+            sendFrame(conn, FrameType::System, "Joined '" + roomName + "', now chatting there");
+            joinRoom(conn, roomName, since);
+            return true;
+        }
+        else if (id == CommandId::Leave) {
+            // /leave [ROOM], the current room by default
+            std::string_view roomArg = words.next();
+            size_t index = roomArg.empty() ? conn.rooms.size() - 1 : findSubscription(conn, roomArg);
+            if (index >= conn.rooms.size()) {
+                sendFrame(conn, FrameType::Error, "You have not joined '" + std::string(roomArg) + "'");
+                return true;
+            }
+            if (conn.rooms.size() == 1) {
+                sendFrame(conn, FrameType::Error, "Join another room before leaving your only one");
+                return true;
+            }
+            std::string roomName = conn.rooms[index].name.str();
+            leaveRoom(conn, index);
+            sendFrame(conn, FrameType::System,
+                      "Left '" + roomName + "', now chatting in '" + conn.rooms.back().name.str() + "'");
+            return true;
+        }
+        else if (id == CommandId::Msg) {
+            // /msg USER TEXT
+            std::string_view target = words.next();
+            std::string_view text = words.remainder();
+            if (target.empty() || text.empty()) {
+                sendFrame(conn, FrameType::Error, "Usage: /msg USER TEXT");
+                return true;
+            }
+            sendDirectMessage(conn, target, text);
+            return true;
+        }
+        else if (id == CommandId::Stats) {
+            sendFrame(conn, FrameType::System, statsText());
+            return true;
+        }
+        else if (id == CommandId::Help) {
+            std::string help = "\n=== Available Commands ===\n";
+            help += "/list - Show users in current room\n";
+            help += "/rooms - Show all available rooms\n";
+            help += "/join <room> [since] - Follow another room as well and chat there\n";
+            help += "/leave [room] - Stop following a room (default: the current one)\n";
+            help += "/msg <user> <text> - Send a private message, kept for later if the user is offline\n";
+            help += "/history [since] [limit] - Replay messages after sequence id <since>\n";
+            help += "/stats - Show server metrics\n";
+            help += "/quit - Leave the chat\n";
+            help += "/help - Show this help message\n";
+            sendFrame(conn, FrameType::System, help);
+            return true;
+        }
+        
+        return false;
+    }
+    
+    struct RoomStats {
+        std::string name;
+        size_t members;
+        uint64_t messages;
+        double rate;
+        size_t residentBytes;
+        bool idle;
+    };
+    
+    struct RoomDirectoryStats {
+        size_t idle = 0;
+        size_t chargedBytes = 0;
+        uint64_t evicted = 0;
+        uint64_t loaded = 0;
+    };
+    
+    std::vector<RoomStats> collectRoomStats(RoomDirectoryStats& directoryStats) {
+        std::vector<std::pair<std::shared_ptr<Room>, bool>> directory;
+        {
+            TimedLockGuard lock(roomsMutex, LockClass::RoomDirectory);
+            directory.reserve(rooms.size());
+            for (const auto& roomPair : rooms) {
+                directory.emplace_back(roomPair.second, roomPair.second->idle);
+            }
+            directoryStats.idle = idleRooms.size();
+            directoryStats.evicted = roomsEvicted;
+            directoryStats.loaded = roomsLoaded;
+        }
+        directoryStats.chargedBytes = roomBytes.load(std::memory_order_relaxed);
+        
+        uint64_t nowNs = ClockService::monotonicNanos();
+        std::vector<RoomStats> stats;
+        stats.reserve(directory.size());
+        for (const auto& entry : directory) {
+            Room& room = *entry.first;
+            size_t memberBytes;
+            {
+                TimedLockGuard lock(room.membersMutex, LockClass::RoomMembers);
+                memberBytes = room.memberBytes();
+            }
+            TimedLockGuard lock(room.roomMutex, LockClass::RoomHistory);
+            stats.push_back(RoomStats{room.name, room.memberCount(), room.messageCount, room.messageRate(nowNs),
+                                      room.chargedBytes + memberBytes, entry.second});
+        }
+        return stats;
+    }
+    
+    MetricsTotals collectTotals(LatencyHistogram& fanoutLatency, LatencyHistogram& fanoutCompletion) {
+        MetricsTotals totals;
+        for (const auto& shard : shards) {
+            totals.add(shard->metrics);
+            fanoutLatency.merge(shard->metrics.fanoutLatency);
+            fanoutCompletion.merge(shard->metrics.fanoutCompletion);
+        }
+        return totals;
+    }
+    
+    static std::string formatMicros(uint64_t ns) {
+        std::ostringstream out;
+        out << (double)ns / 1000.0 << " us";
+        return out.str();
+    }
+    
+    // What an idle connection costs: its state and its session's coroutine
+    // frame, as the slab rounds them up. Reading goes through the shard's
+    // buffer, so nothing else is held between messages.
+    static size_t idleSessionBytes() {
+        return SlabPool::blockSize(sizeof(Connection)) + SlabPool::blockSize(SessionTask::frameBytes());
+    }
+    
+    // Human-readable report for /stats and shutdown
+    std::string statsText() {
+        auto fanoutLatency = std::make_unique<LatencyHistogram>();
+        auto fanoutCompletion = std::make_unique<LatencyHistogram>();
+        MetricsTotals totals = collectTotals(*fanoutLatency, *fanoutCompletion);
+        RoomDirectoryStats directoryStats;
+        std::vector<RoomStats> roomStats = collectRoomStats(directoryStats);
+        
+        std::ostringstream out;
+        out << "\n=== Server Stats ===\n"
+            << "Connections: " << totals.openConnections << " open, " << totals.connectionsAccepted << " accepted, "
+            << totals.connectionsClosed << " closed\n"
+            << "Messages: " << totals.messagesReceived << " received, " << totals.messagesQueued << " deliveries queued\n"
+            << "Bytes: " << totals.bytesReceived << " in, " << totals.bytesSent << " out\n"
+            << "Output: " << totals.outputWrites << " writes for " << totals.messagesQueued << " deliveries, "
+            << totals.flushesHeld << " flushes held for batching, " << totals.batchingConnections
+            << " connections batching\n"
+            << "Outbound queues: " << totals.queuedMessages << " messages, " << totals.queuedBytes << " bytes\n"
+            << "History replays: " << totals.replaysActive << " streaming, " << totals.replaysDeferred << " deferred\n"
+            << "Private messages: " << totals.directSent << " delivered, " << totals.directStored << " kept for offline users, "
+            << totals.directRefused << " refused; " << users.bufferedMessages() << " waiting (" << users.bufferedBytes()
+            << " bytes)\n"
+            << "Keepalive: " << totals.pingsSent << " pings sent, " << totals.idleTimeouts << " idle timeouts, "
+            << totals.handshakeTimeouts << " handshake timeouts\n"
+            << "Fan-out latency: p50 " << formatMicros(fanoutLatency->percentile(0.50))
+            << ", p99 " << formatMicros(fanoutLatency->percentile(0.99))
+            << ", p999 " << formatMicros(fanoutLatency->percentile(0.999))
+            << ", max " << formatMicros(fanoutLatency->max()) << "\n"
+            << "Fan-out completion: p50 " << formatMicros(fanoutCompletion->percentile(0.50))
+            << ", p99 " << formatMicros(fanoutCompletion->percentile(0.99))
+            << ", p999 " << formatMicros(fanoutCompletion->percentile(0.999))
+            << ", max " << formatMicros(fanoutCompletion->max()) << "; " << totals.fanoutDeferred
+            << " room messages waited in a shard's fan-out queue\n";
+        for (size_t i = 0; i < RATE_SCOPE_COUNT; ++i) {
+            out << "Rate limit " << rateScopeName((RateScope)i) << ": " << totals.rateShed[i] << " shed, "
+                << totals.rateDelayed[i] << " delayed\n";
+        }
+        AllocatorStats slabs = SlabPool::totals();
+        out << "Allocator: " << slabs.slabBytes / 1024 << " KiB in slabs, " << slabs.blocksInUse << " blocks in use, "
+            << slabs.allocations << " slab allocations (" << slabs.remoteFrees << " freed remotely), "
+            << slabs.heapFallbacks << " oversize, " << globalAllocations.load(std::memory_order_relaxed)
+            << " global heap calls, " << names.size() << " interned names\n";
+        out << "Sessions: " << idleSessionBytes() << " bytes per idle connection (" << sizeof(Connection)
+            << " connection, " << SessionTask::frameBytes() << " coroutine frame)\n";
+        for (size_t i = 0; i < LOCK_CLASS_COUNT; ++i) {
+            out << "Lock " << lockClassName((LockClass)i) << ": " << totals.lockContended[i] << " contended, "
+                << formatMicros(totals.lockWaitNs[i]) << " waited\n";
+        }
+        out << "Rooms: " << roomStats.size() << " resident (" << directoryStats.idle << " idle), "
+            << directoryStats.chargedBytes / 1024 << " KiB of " << config.roomMemory / 1024 << " KiB budget; "
+            << directoryStats.evicted << " evicted, " << directoryStats.loaded << " loaded from disk\n";
+        for (const RoomStats& room : roomStats) {
+            out << "- " << room.name << ": " << room.members << " users, " << room.messages << " messages, "
+                << room.rate << " msg/s, " << room.residentBytes / 1024 << " KiB resident"
+                << (room.idle ? ", idle" : "") << "\n";
+        }
+        return out.str();
+    }
+    
+    static std::string prometheusLabel(const std::string& value) {
+        std::string escaped;
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                escaped += '\\';
+                escaped += c;
+            }
+            else if (c == '\n') {
+                escaped += "\\n";
+            }
+            else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+    
+    // Prometheus text exposition format, version 0.0.4
+    std::string prometheusText() {
+        auto fanoutLatency = std::make_unique<LatencyHistogram>();
+        auto fanoutCompletion = std::make_unique<LatencyHistogram>();
+        MetricsTotals totals = collectTotals(*fanoutLatency, *fanoutCompletion);
+        RoomDirectoryStats directoryStats;
+        std::vector<RoomStats> roomStats = collectRoomStats(directoryStats);
+        
+        std::ostringstream out;
+        auto metric = [&out](const char* name, const char* type, const char* help, uint64_t value) {
+            out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n"
+                << name << " " << value << "\n";
+        };
+        metric("chat_connections_open", "gauge", "Connected client sockets.", totals.openConnections);
+        metric("chat_connections_accepted_total", "counter", "Client sockets accepted.", totals.connectionsAccepted);
+        metric("chat_connections_closed_total", "counter", "Client sockets closed.", totals.connectionsClosed);
+        metric("chat_messages_received_total", "counter", "Chat messages received from clients.", totals.messagesReceived);
+        metric("chat_deliveries_queued_total", "counter", "Messages queued to client sockets.", totals.messagesQueued);
+        metric("chat_bytes_received_total", "counter", "Bytes read from client sockets.", totals.bytesReceived);
+        metric("chat_bytes_sent_total", "counter", "Bytes written to client sockets.", totals.bytesSent);
+        metric("chat_output_writes_total", "counter", "Send calls writing queued output.", totals.outputWrites);
+        metric("chat_output_flushes_held_total", "counter", "Flushes held back to batch a busy connection's output.",
+               totals.flushesHeld);
+        metric("chat_output_batching_connections", "gauge", "Connections currently flushing in batches.",
+               totals.batchingConnections);
+        metric("chat_outbound_queue_messages", "gauge", "Messages waiting in outbound queues.", totals.queuedMessages);
+        metric("chat_outbound_queue_bytes", "gauge", "Bytes waiting in outbound queues.", totals.queuedBytes);
+        AllocatorStats slabs = SlabPool::totals();
+        metric("chat_slab_bytes", "gauge", "Memory reserved by the shards' slab allocators.", slabs.slabBytes);
+        metric("chat_slab_blocks_in_use", "gauge", "Slab blocks currently allocated.", slabs.blocksInUse);
+        metric("chat_slab_allocations_total", "counter", "Blocks handed out by the slab allocators.", slabs.allocations);
+        metric("chat_slab_remote_frees_total", "counter", "Slab blocks freed by a thread other than their owner.",
+               slabs.remoteFrees);
+        metric("chat_heap_allocations_total", "counter", "Calls to the global allocator.",
+               globalAllocations.load(std::memory_order_relaxed));
+        metric("chat_session_idle_bytes", "gauge", "Slab memory held by one idle connection and its coroutine.",
+               idleSessionBytes());
+        metric("chat_interned_names", "gauge", "Distinct usernames and room names in use.", names.size());
+        metric("chat_direct_messages_total", "counter", "Private messages sent to connected users.", totals.directSent);
+        metric("chat_direct_messages_stored_total", "counter", "Private messages kept for offline users.",
+               totals.directStored);
+        metric("chat_direct_messages_refused_total", "counter", "Private messages refused with the offline buffer full.",
+               totals.directRefused);
+        metric("chat_fanout_deferred_total", "counter", "Room messages that waited in a shard's fan-out queue.",
+               totals.fanoutDeferred);
+        metric("chat_direct_messages_waiting", "gauge", "Private messages waiting for offline users.",
+               users.bufferedMessages());
+        metric("chat_direct_messages_waiting_bytes", "gauge", "Memory charged to the offline message buffer.",
+               users.bufferedBytes());
+        metric("chat_pings_sent_total", "counter", "Keepalive pings sent to idle clients.", totals.pingsSent);
+        metric("chat_idle_timeouts_total", "counter", "Clients closed for not answering a ping.", totals.idleTimeouts);
+        metric("chat_handshake_timeouts_total", "counter", "Connections closed before completing the handshake.",
+               totals.handshakeTimeouts);
+        metric("chat_history_replays_active", "gauge", "History replays currently streaming.", totals.replaysActive);
+        metric("chat_history_replays_deferred_total", "counter", "History replays that waited for a free slot.",
+               totals.replaysDeferred);
+        metric("chat_slow_consumer_dropped_total", "counter", "Messages dropped for slow consumers.",
+               slowConsumerStats.droppedMessages.load(std::memory_order_relaxed));
+        metric("chat_slow_consumer_disconnects_total", "counter", "Clients disconnected for being too slow.",
+               slowConsumerStats.disconnects.load(std::memory_order_relaxed));
+        metric("chat_rooms", "gauge", "Rooms in the directory.", roomStats.size());
+        metric("chat_rooms_idle", "gauge", "Resident rooms nobody has joined.", directoryStats.idle);
+        metric("chat_room_memory_bytes", "gauge", "Memory resident rooms count against the room budget.",
+               directoryStats.chargedBytes);
+        metric("chat_room_memory_budget_bytes", "gauge", "Room memory above which idle rooms are evicted.",
+               config.roomMemory);
+        metric("chat_room_evictions_total", "counter", "Idle rooms evicted to stay within the budget.",
+               directoryStats.evicted);
+        metric("chat_room_loads_total", "counter", "Rooms whose history was loaded back from disk.",
+               directoryStats.loaded);
+        if (roomLogs) {
+            metric("chat_history_commits_total", "counter", "Group commits of the on-disk room history.",
+                   roomLogs->commitCount());
+        }
+        metric("chat_log_records_dropped_total", "counter", "Log records dropped because a log ring was full.",
+               AsyncLogger::instance().droppedCount());
+        metric("chat_log_chat_lines_shed_total", "counter", "Chat content log lines shed under load.",
+               AsyncLogger::instance().shedCount());
+        
+        out << "# HELP chat_lock_contended_total Lock acquisitions that had to wait.\n"
+            << "# TYPE chat_lock_contended_total counter\n";
+        for (size_t i = 0; i < LOCK_CLASS_COUNT; ++i) {
+            out << "chat_lock_contended_total{lock=\"" << lockClassName((LockClass)i) << "\"} " << totals.lockContended[i] << "\n";
+        }
+        out << "# HELP chat_lock_wait_seconds_total Time spent waiting for locks.\n"
+            << "# TYPE chat_lock_wait_seconds_total counter\n";
+        for (size_t i = 0; i < LOCK_CLASS_COUNT; ++i) {
+            out << "chat_lock_wait_seconds_total{lock=\"" << lockClassName((LockClass)i) << "\"} "
+                << (double)totals.lockWaitNs[i] / 1e9 << "\n";
+        }
+        
+        out << "# HELP chat_rate_limited_total Messages or accepts over a rate limit, by scope and action.\n"
+            << "# TYPE chat_rate_limited_total counter\n";
+        for (size_t i = 0; i < RATE_SCOPE_COUNT; ++i) {
+            out << "chat_rate_limited_total{scope=\"" << rateScopeName((RateScope)i) << "\",action=\"shed\"} "
+                << totals.rateShed[i] << "\n"
+                << "chat_rate_limited_total{scope=\"" << rateScopeName((RateScope)i) << "\",action=\"delayed\"} "
+                << totals.rateDelayed[i] << "\n";
+        }
+        
+        out << "# HELP chat_room_members Users in each room.\n# TYPE chat_room_members gauge\n";
+        for (const RoomStats& room : roomStats) {
+            out << "chat_room_members{room=\"" << prometheusLabel(room.name) << "\"} " << room.members << "\n";
+        }
+        out << "# HELP chat_room_messages_total Messages added to each room.\n# TYPE chat_room_messages_total counter\n";
+        for (const RoomStats& room : roomStats) {
+            out << "chat_room_messages_total{room=\"" << prometheusLabel(room.name) << "\"} " << room.messages << "\n";
+        }
+        out << "# HELP chat_room_resident_bytes Memory held by each room, its members included.\n"
+            << "# TYPE chat_room_resident_bytes gauge\n";
+        for (const RoomStats& room : roomStats) {
+            out << "chat_room_resident_bytes{room=\"" << prometheusLabel(room.name) << "\"} " << room.residentBytes << "\n";
+        }
+        
+        static const double bucketBounds[] = {
+            1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1.0
+        };
+        auto histogram = [&out](const char* name, const char* help, const LatencyHistogram& values) {
+            out << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+            for (double bound : bucketBounds) {
+                uint64_t cumulative = 0;
+                values.forEachBucket([&](uint64_t upperNs, uint64_t count) {
+                    if ((double)upperNs <= bound * 1e9) {
+                        cumulative += count;
+                    }
+                });
+                out << name << "_bucket{le=\"" << bound << "\"} " << cumulative << "\n";
+            }
+            out << name << "_bucket{le=\"+Inf\"} " << values.count() << "\n"
+                << name << "_sum " << values.mean() * (double)values.count() / 1e9 << "\n"
+                << name << "_count " << values.count() << "\n";
+        };
+        histogram("chat_fanout_latency_seconds",
+                  "Time from reading a message to queueing it for every recipient on a shard.", *fanoutLatency);
+        histogram("chat_fanout_completion_seconds",
+                  "Time from reading a message to queueing it for every recipient on every shard.", *fanoutCompletion);
+        return out.str();
+    }
+    
+    // One blocking request per scrape; the endpoint is loopback-only and
+    // scraped every few seconds, so a plain sequential server is enough
+    void serveMetricsRequest(SOCKET client) {
+        setSocketNonBlocking(client, false);
+        setSocketReceiveTimeout(client, 1000);
+        
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            int received = recv(client, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                break;
+            }
+            request.append(buffer, received);
+        }
+        
+        bool found = request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0;
+        std::string body = found ? prometheusText() : "Not found\n";
+        std::string response = std::string(found ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 404 Not Found\r\n") +
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            "Connection: close\r\n\r\n" + body;
+        
+        size_t sent = 0;
+        while (sent < response.size()) {
+            int result = send(client, response.data() + sent, (int)(response.size() - sent), MSG_NOSIGNAL);
+            if (result <= 0) {
+                break;
+            }
+            sent += result;
+        }
+        closesocket(client);
+    }
+    
+    void runMetricsEndpoint() {
+        Poller poller;
+        if (!poller.valid() || !poller.add(metricsSocket, nullptr)) {
+            logMessage(LogLevel::Error, "Metrics endpoint registration failed");
+            return;
+        }
+        
+        std::vector<PollEvent> events;
+        while (running && !shutdownRequested) {
+            poller.wait(events, 500);
+            if (events.empty()) {
+                continue;
+            }
+            SOCKET client;
+            while ((client = accept(metricsSocket, nullptr, nullptr)) != INVALID_SOCKET) {
+                serveMetricsRequest(client);
+            }
+        }
+        poller.remove(metricsSocket);
+    }
+    
+    SOCKET createListenSocket(unsigned short port, unsigned long address, bool reusePort) {
+        SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenSocket == INVALID_SOCKET) {
+            std::cerr << "Socket creation failed\n";
+            return INVALID_SOCKET;
+        }
+        
+        int enable = 1;
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&enable, sizeof(enable));
+#ifdef SO_REUSEPORT
+        if (reusePort) {
+            // The kernel load-balances new connections across every socket
+            // bound to the port with this option set
+            setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, (const char*)&enable, sizeof(enable));
+        }
+#else
+        (void)reusePort;
+#endif
+        
+        sockaddr_in serverAddr{};
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(port);
+        serverAddr.sin_addr.s_addr = htonl(address);
+        
+        if (bind(listenSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+            std::cerr << "Bind failed\n";
+            closesocket(listenSocket);
+            return INVALID_SOCKET;
+        }
+        
+        if (listen(listenSocket, config.listenBacklog) == SOCKET_ERROR) {
+            std::cerr << "Listen failed\n";
+            closesocket(listenSocket);
+            return INVALID_SOCKET;
+        }
+        
+        if (!setSocketNonBlocking(listenSocket)) {
+            std::cerr << "Listen socket registration failed\n";
+            closesocket(listenSocket);
+            return INVALID_SOCKET;
+        }
+        
+        return listenSocket;
+    }
+    
+    // Handshake line: USERNAME|ROOM[|option...]
+    void handleHandshake(Connection& conn, const std::string& message) {
+        SOCKET clientSocket = conn.socket;
+        // Parse username and room
+        
+        size_t pos = message.find('|');
+        if (pos == std::string::npos) {
+            std::string usage = "Please send your username and room in format: USERNAME|ROOM";
+            sendFrame(conn, FrameType::Error, usage);
+            return;
+        }
+        
+        std::string username = message.substr(0, pos);
+        std::string room = message.substr(pos + 1);
+        
+        // Trailing options negotiate the wire mode and where history resumes
+        bool framed = false;
+        uint64_t sinceSeq = 0;
+        size_t optionPos;
+        size_t sinceLength = strlen(HANDSHAKE_SINCE_OPTION);
+        while ((optionPos = room.rfind('|')) != std::string::npos) {
+            if (room.compare(optionPos + 1, std::string::npos, HANDSHAKE_FRAMED_OPTION) == 0) {
+                framed = true;
+            }
+            else if (room.compare(optionPos + 1, sinceLength, HANDSHAKE_SINCE_OPTION) == 0) {
+                sinceSeq = std::strtoull(room.c_str() + optionPos + 1 + sinceLength, nullptr, 10);
+            }
+            room.erase(optionPos);
+        }
+        
+        // Remove newline characters
+        username.erase(std::remove(username.begin(), username.end(), '\n'), username.end());
+        username.erase(std::remove(username.begin(), username.end(), '\r'), username.end());
+        room.erase(std::remove(room.begin(), room.end(), '\n'), room.end());
+        room.erase(std::remove(room.begin(), room.end(), '\r'), room.end());
+        
+        if (username.empty()) username = "Anonymous";
+        if (room.empty()) room = "General";
+        if (room.size() > MAX_ROOM_NAME) {
+            sendFrame(conn, FrameType::Error, "Room names are limited to " + std::to_string(MAX_ROOM_NAME) + " bytes");
+            return;
+        }
+        
+        if (framed) {
+            conn.parser.setMode(FrameParser::Framed);
+        }
+        
+        // Add client to our list
+        conn.username = InternedName(names, username);
+        clients.add(clientSocket, conn.username);
+        conn.userInfoReceived = true;
+        
+        // Send welcome message
+        sendFrame(conn, FrameType::System, "Welcome to the chat server!");
+        joinRoom(conn, room, sinceSeq);
+        
+        // Private messages that arrived while the user was away
+        std::vector<SharedBuffer> waiting;
+        users.connect(username, UserDirectory::Endpoint{conn.shard->index, clientSocket, conn.username.id()}, waiting);
+        if (!waiting.empty()) {
+            sendFrame(conn, FrameType::System,
+                      std::to_string(waiting.size()) + " private message(s) arrived while you were away:");
+            for (const SharedBuffer& message : waiting) {
+                queueSend(conn, wireView(message, isFramed(conn)));
+            }
+        }
+        
+        armIdleTimer(conn, ClockService::monotonicNanos());
+        logMessage(LogLevel::Info, "Client ", username, " joined room ", room);
+    }
+    
+    // Subscribe to a room and make it the one chat goes to: replay its
+    // history (what the client missed after `sinceSeq`, or the recent
+    // messages) and tell the other members
+    void joinRoom(Connection& conn, const std::string& roomName, uint64_t sinceSeq) {
+        Shard& shard = *conn.shard;
+        std::shared_ptr<Room> room = acquireRoom(roomName);
+        conn.rooms.push_back(RoomSubscription{InternedName(names, roomName), room});
+        clients.joinRoom(conn.socket, conn.rooms.back().name.id());
+        addToRoom(*room, conn);
+        {
+            TimedLockGuard lock(room->roomMutex, LockClass::RoomHistory);
+            conn.rooms.back().joinedSeq = room->history.nextSequence() - 1;
+        }
+        
+        sendMessageHistory(conn, room, sinceSeq, sinceSeq != 0 ? HISTORY_MAX_LIMIT : room->history.capacity());
+        
+        std::string& joinMsg = beginLine(shard);
+        joinMsg += conn.username.str();
+        joinMsg += " joined the room '";
+        joinMsg += roomName;
+        joinMsg += '\'';
+        uint64_t seq = addMessageToRoom(*room, joinMsg);
+        sendMessageToRoom(shard, room, FrameType::System, joinMsg, seq, conn.socket);
+    }
+    
+    void leaveRoom(Connection& conn, size_t index) {
+        Shard& shard = *conn.shard;
+        RoomSubscription left = std::move(conn.rooms[index]);
+        conn.rooms.erase(conn.rooms.begin() + index);
+        // Out of the registry first, so a /list rendered in between cannot
+        // cache the departed member
+        clients.leaveRoom(conn.socket, left.name.id());
+        removeFromRoom(*left.room, conn);
+        
+        // Replays of the room that have not started yet go with it
+        if (conn.history) {
+            std::unique_ptr<HistoryCursor>* link = &conn.history->next;
+            while (*link) {
+                if ((*link)->room == left.room) {
+                    *link = std::move((*link)->next);
+                }
+                else {
+                    link = &(*link)->next;
+                }
+            }
+        }
+        
+        std::string& leaveMsg = beginLine(shard);
+        leaveMsg += conn.username.str();
+        leaveMsg += " left the room";
+        uint64_t seq = addMessageToRoom(*left.room, leaveMsg);
+        sendMessageToRoom(shard, left.room, FrameType::System, leaveMsg, seq);
+        releaseRoom(*left.room);
+    }
+    
+    // A private message goes straight to the recipient's connections, found
+    // through the user directory, and is queued like room traffic; a
+    // recipient on another shard gets it through that shard's inbox. The
+    // sender sees its own copy. If the recipient is not connected it waits
+    // in the directory's offline buffer.
+    void sendDirectMessage(Connection& conn, std::string_view target, std::string_view text) {
+        Shard& shard = *conn.shard;
+        std::string& line = beginLine(shard);
+        line += conn.username.str();
+        line += " -> ";
+        line.append(target.data(), target.size());
+        line += ": ";
+        line.append(text.data(), text.size());
+        SharedBuffer encoded = encodeSharedMessage(FrameType::Direct, line);
+        
+        std::vector<UserDirectory::Endpoint>& targets = shard.directTargets;
+        UserDirectory::Route route = users.route(target, encoded, targets);
+        if (route == UserDirectory::Route::Refused) {
+            shard.metrics.directRefused.add();
+            sendFrame(conn, FrameType::Error, std::string(target) + " is offline and no more messages can be kept");
+            return;
+        }
+        if (route == UserDirectory::Route::Stored) {
+            shard.metrics.directStored.add();
+            queueSend(conn, wireView(encoded, isFramed(conn)));
+            sendFrame(conn, FrameType::System, std::string(target) + " is offline; they get the message when they connect");
+            return;
+        }
+        
+        shard.metrics.directSent.add();
+        bool toSelf = false;
+        for (const UserDirectory::Endpoint& to : targets) {
+            if (to.shard == shard.index) {
+                toSelf = toSelf || to.socket == conn.socket;
+                deliverDirect(shard, to.socket, to.user, encoded);
+                continue;
+            }
+            ShardMessage post;
+            post.kind = ShardMessage::Direct;
+            post.socket = to.socket;
+            post.recipient = to.user;
+            post.message = encoded;
+            shards[to.shard]->inbox.push(std::move(post));
+            shards[to.shard]->wakeup.notify();
+        }
+        targets.clear();
+        if (!toSelf) {
+            queueSend(conn, wireView(encoded, isFramed(conn)));
+        }
+    }
+    
+    void deliverDirect(Shard& shard, SOCKET socket, NameId recipient, const SharedBuffer& encoded) {
+        auto it = shard.connections.find(socket);
+        if (it != shard.connections.end() && it->second->userInfoReceived && it->second->username.id() == recipient) {
+            queueSend(*it->second, wireView(encoded, isFramed(*it->second)));
+        }
+    }
+    
+    // Framed clients answer pings. Legacy text clients cannot, so they are
+    // left to the kernel's TCP keepalive set up when they were accepted.
+    void armIdleTimer(Connection& conn, uint64_t nowNs) {
+        if (config.idleTimeoutSec > 0 && isFramed(conn)) {
+            conn.shard->timers.arm(conn.timer, nowNs, config.idleTimeoutSec * 1000000000ULL);
+        }
+        else {
+            conn.shard->timers.cancel(conn.timer);
+        }
+    }
+    
+    // The connection's single timer fired. Traffic does not touch the
+    // timer, it only moves lastReceiveNs, so a busy connection costs one
+    // re-arm per idle period rather than one per message.
+    void onConnectionTimer(Connection& conn) {
+        if (conn.closing) {
+            return;
+        }
+        uint64_t nowNs = ClockService::monotonicNanos();
+        if (!conn.userInfoReceived) {
+            conn.shard->metrics.handshakeTimeouts.add();
+            logMessage(LogLevel::Info, "Closing connection that never completed the handshake");
+            scheduleClose(conn);
+            return;
+        }
+        if (conn.pingSentNs != 0) {
+            if (conn.lastReceiveNs < conn.pingSentNs) {
+                conn.shard->metrics.idleTimeouts.add();
+                logMessage(LogLevel::Info, "Client ", conn.username.str(), " did not answer a ping, closing");
+                scheduleClose(conn);
+                return;
+            }
+            conn.pingSentNs = 0;
+        }
+        
+        uint64_t idleLimitNs = config.idleTimeoutSec * 1000000000ULL;
+        uint64_t idleNs = nowNs - conn.lastReceiveNs;
+        if (idleNs < idleLimitNs) {
+            conn.shard->timers.arm(conn.timer, nowNs, idleLimitNs - idleNs);
+            return;
+        }
+        conn.pingSentNs = nowNs;
+        conn.shard->metrics.pingsSent.add();
+        sendFrame(conn, FrameType::Ping, "");
+        conn.shard->timers.arm(conn.timer, nowNs, config.pingTimeoutSec * 1000000000ULL);
+    }
+    
+    void handleFrame(Connection& conn, const Frame& frame) {
+        if (!conn.userInfoReceived) {
+            handleHandshake(conn, std::string(frame.payload));
+            return;
+        }
+        if ((frame.type == FrameType::Chat || frame.type == FrameType::Command) &&
+            !admitMessage(conn, frame.type, frame.payload)) {
+            return;
+        }
+        handleMessage(conn, frame.type, frame.payload);
+    }
+    
+    // Charge a message to the sender's connection and source address, and a
+    // chat message to its room as well. False if any of them is out of
+    // tokens: the message is then shed, or held until they refill.
+    bool admitMessage(Connection& conn, FrameType type, std::string_view payload) {
+        uint64_t nowNs = ClockService::monotonicNanos();
+        RateScope scope;
+        uint64_t waitNs;
+        if (takeMessageTokens(conn, type, nowNs, scope, waitNs)) {
+            conn.rateNoticeSent = false;
+            return true;
+        }
+        if (config.ratePolicy == RatePolicy::Shed) {
+            shedMessage(conn, scope);
+            return false;
+        }
+        // The session stops reading and sleeps until it may go through
+        conn.shard->metrics.rateDelayed[(size_t)scope].add();
+        conn.holding = true;
+        conn.heldType = type;
+        conn.held.assign(payload.data(), payload.size());
+        conn.holdNs = waitNs;
+        return false;
+    }
+    
+    // A message is charged to every bucket that applies or to none: tokens
+    // taken before a later bucket refuses are given back, so a message held
+    // back by a busy room does not drain its sender's budgets on each retry
+    bool takeMessageTokens(Connection& conn, FrameType type, uint64_t nowNs, RateScope& scope, uint64_t& waitNs) {
+        if (!conn.rateBucket.tryTake(config.connectionRate, nowNs, waitNs)) {
+            scope = RateScope::Connection;
+            return false;
+        }
+        TokenBucket& addressBucket = addressRates.bucketFor(conn.peerAddress);
+        if (!addressBucket.tryTake(config.addressRate, nowNs, waitNs)) {
+            conn.rateBucket.refund(config.connectionRate);
+            scope = RateScope::Address;
+            return false;
+        }
+        if (type == FrameType::Chat && !activeRoom(conn)->rateBucket.tryTake(config.roomRate, nowNs, waitNs)) {
+            addressBucket.refund(config.addressRate);
+            conn.rateBucket.refund(config.connectionRate);
+            scope = RateScope::Room;
+            return false;
+        }
+        return true;
+    }
+    
+    void shedMessage(Connection& conn, RateScope scope) {
+        conn.shard->metrics.rateShed[(size_t)scope].add();
+        if (!conn.rateNoticeSent) {
+            conn.rateNoticeSent = true;
+            sendFrame(conn, FrameType::Error,
+                      std::string("Rate limit exceeded (") + rateScopeName(scope) + "), message dropped");
+        }
+    }
+    
+    // Retry the held message; false, with holdNs updated, if it still has
+    // to wait
+    bool releaseHeld(Connection& conn) {
+        RateScope scope;
+        if (!takeMessageTokens(conn, conn.heldType, ClockService::monotonicNanos(), scope, conn.holdNs)) {
+            return false;
+        }
+        conn.holding = false;
+        handleMessage(conn, conn.heldType, conn.held);
+        std::string().swap(conn.held);
+        return true;
+    }
     
-    Client(SOCKET s) : socket(s), connected(true) {}
-};
-
-struct Room {
-    std::vector<std::string> messageHistory;
-    std::vector<SOCKET> clients;
-    std::mutex roomMutex;
-};
-
-class ChatServer {
-private:
-    SOCKET serverSocket;
-    std::vector<Client> clients;
-    std::mutex clientsMutex;
-    std::map<std::string, Room> rooms;
-    std::mutex roomsMutex;
-    bool running;
+    void handleMessage(Connection& conn, FrameType type, std::string_view payload) {
+        // Handle regular messages and commands
+        if (type == FrameType::Command) {
+            if (!handleCommand(conn, payload)) {
+                std::string errorMsg = "Unknown command. Type /help for available commands.";
+                sendFrame(conn, FrameType::Error, errorMsg);
+            }
+        }
+        else if (type == FrameType::Chat) {
+            // Regular message
+            std::string& fullMessage = beginLine(*conn.shard);
+            fullMessage += conn.username.str();
+            fullMessage += ": ";
+            fullMessage.append(payload.data(), payload.size());
+            const RoomSubscription& target = conn.rooms.back();
+            uint64_t seq = addMessageToRoom(*target.room, fullMessage);
+            conn.shard->metrics.messagesReceived.add();
+            sendMessageToRoom(*conn.shard, target.room, FrameType::Chat, fullMessage, seq, conn.socket, conn.lastReceiveNs);
+            logChat('[', target.name.str(), "] ", fullMessage);
+        }
+        else if (type == FrameType::Ping) {
+            sendFrame(conn, FrameType::Pong, std::string(payload));
+        }
+        else if (type == FrameType::Pong) {
+            // Receiving it already counted as activity
+        }
+        else {
+            sendFrame(conn, FrameType::Error, "Unexpected frame type");
+        }
+    }
     
-    std::string getCurrentTime() {
-        time_t now = time(0);
-        struct tm timeinfo;
-        localtime_s(&timeinfo, &now);
-        char buffer[80];
-        strftime(buffer, sizeof(buffer), "%H:%M:%S", &timeinfo);
-        return std::string(buffer);
+    // Suspend the session until `delayNs` has passed. The connection's timer
+    // is borrowed, so the caller re-arms it for whatever it was timing.
+    SessionWait sleepFor(Connection& conn, uint64_t delayNs) {
+        conn.wakeFired &= ~WAKE_TIMER;
+        conn.shard->timers.arm(conn.timer, ClockService::monotonicNanos(), delayNs);
+        return SessionWait{conn, WAKE_TIMER};
     }
     
-    void addToRoom(const std::string& roomName, SOCKET clientSocket) {
-        std::lock_guard<std::mutex> lock(roomsMutex);
-        rooms[roomName].clients.push_back(clientSocket);
+    void wakeSession(Connection& conn, unsigned event) {
+        conn.wakeFired |= event;
+        if (conn.waiter && (conn.wakeOn & event) != 0 && !conn.resumeQueued && !conn.closing) {
+            conn.resumeQueued = true;
+            conn.shard->pendingResume.push_back(&conn);
+        }
     }
     
-    void removeFromRoom(const std::string& roomName, SOCKET clientSocket) {
-        std::lock_guard<std::mutex> lock(roomsMutex);
-        auto& room = rooms[roomName];
-        room.clients.erase(
-            std::remove(room.clients.begin(), room.clients.end(), clientSocket),
-            room.clients.end()
-        );
+    // Sessions are resumed between event batches, never from inside another
+    // connection's handler
+    void resumeSessions(Shard& shard) {
+        std::vector<Connection*>& batch = shard.resumeBatch;
+        batch.swap(shard.pendingResume);
+        for (Connection* conn : batch) {
+            conn->resumeQueued = false;
+            if (conn->waiter && !conn->closing) {
+                std::coroutine_handle<> waiter = conn->waiter;
+                conn->waiter = nullptr;
+                waiter.resume();
+            }
+        }
+        batch.clear();
     }
     
-    void addMessageToRoom(const std::string& roomName, const std::string& message) {
-        std::lock_guard<std::mutex> lock(roomsMutex);
-        rooms[roomName].messageHistory.push_back(message);
+    // A connection's whole life on the reading side, as straight-line code:
+    // the handshake, then reading and handling messages until it closes.
+    // The session suspends while the socket has nothing to read, while a
+    // message waits for the rate limiter and while its own replies are
+    // backed up; deadlines arrive as timer wakes. TCP may split or merge
+    // messages arbitrarily, so bytes go through the connection's parser
+    // rather than being treated as one message per read.
+    SessionTask runSession(Connection& conn) {
+        Shard& shard = *conn.shard;
+        std::string unread;   // input behind a held message
+        auto onFrame = [this, &conn](const Frame& frame) {
+            handleFrame(conn, frame);
+            return !conn.closing && !conn.holding;
+        };
         
-        // Keep only last 100 messages per room
-        if (rooms[roomName].messageHistory.size() > 100) {
-            rooms[roomName].messageHistory.erase(rooms[roomName].messageHistory.begin());
+        if (config.handshakeTimeoutSec > 0) {
+            shard.timers.arm(conn.timer, conn.lastReceiveNs, config.handshakeTimeoutSec * 1000000000ULL);
+        }
+        
+        while (!conn.closing) {
+            if (conn.holding) {
+                // Leave the socket unread meanwhile; TCP slows the sender down
+                while (!conn.closing && !releaseHeld(conn)) {
+                    co_await sleepFor(conn, conn.holdNs);
+                }
+                armIdleTimer(conn, ClockService::monotonicNanos());
+                
+                size_t consumed = 0;
+                if (!unread.empty() && !conn.parser.feed(unread.data(), unread.size(), onFrame, consumed)) {
+                    sendFrame(conn, FrameType::Error, "Protocol error");
+                    scheduleClose(conn);
+                }
+                unread.erase(0, consumed);
+                if (!conn.holding) {
+                    std::string().swap(unread);
+                }
+                continue;
+            }
+            
+            if (conn.outQueueBytes > SESSION_PAUSE_BYTES) {
+                // Read nothing more until the client has taken some replies
+                if (co_await SessionWait{conn, WAKE_DRAINED | WAKE_TIMER} & WAKE_TIMER) {
+                    onConnectionTimer(conn);
+                }
+                continue;
+            }
+            
+            int bytesReceived = recv(conn.socket, shard.readBuffer, sizeof(shard.readBuffer), 0);
+            if (bytesReceived > 0) {
+                conn.lastReceiveNs = ClockService::monotonicNanos();
+                shard.metrics.bytesReceived.add(bytesReceived);
+                size_t consumed = 0;
+                if (!conn.parser.feed(shard.readBuffer, bytesReceived, onFrame, consumed)) {
+                    sendFrame(conn, FrameType::Error, "Protocol error");
+                    scheduleClose(conn);
+                }
+                else if (conn.holding) {
+                    unread.assign(shard.readBuffer + consumed, bytesReceived - consumed);
+                }
+            }
+            else if (bytesReceived == 0) {
+                logMessage(LogLevel::Info, "Client disconnected: ", conn.username.str());
+                scheduleClose(conn);
+            }
+            else {
+                int error = WSAGetLastError();
+                if (socketWouldBlock(error)) {
+                    if (!conn.holding && (co_await SessionWait{conn, WAKE_READABLE | WAKE_TIMER} & WAKE_TIMER)) {
+                        onConnectionTimer(conn);
+                    }
+                }
+                else if (error != WSAEINTR) {
+                    logMessage(LogLevel::Warn, "Client error: ", error);
+                    scheduleClose(conn);
+                }
+            }
         }
     }
     
-    void sendMessageToRoom(const std::string& roomName, const std::string& message, SOCKET sender = INVALID_SOCKET) {
-        std::lock_guard<std::mutex> lock(roomsMutex);
-        auto it = rooms.find(roomName);
-        if (it != rooms.end()) {
-            for (SOCKET client : it->second.clients) {
-                if (client != sender && client != INVALID_SOCKET) {
-                    send(client, message.c_str(), message.length(), 0);
-                }
+    void closeConnection(Connection& conn) {
+        Shard& shard = *conn.shard;
+        SOCKET clientSocket = conn.socket;
+        
+        // Cleanup
+        if (conn.userInfoReceived) {
+            // Notify others in every room
+            while (!conn.rooms.empty()) {
+                leaveRoom(conn, conn.rooms.size() - 1);
             }
+            
+            // Remove from clients list
+            clients.remove(clientSocket);
+            users.disconnect(conn.username.str(), UserDirectory::Endpoint{shard.index, clientSocket, conn.username.id()});
+        }
+        
+        if (conn.history && conn.history->admitted) {
+            conn.history.reset();
+            releaseReplay(shard);
+        }
+        shard.timers.cancel(conn.timer);
+        if (conn.resumeQueued) {
+            shard.pendingResume.erase(std::remove(shard.pendingResume.begin(), shard.pendingResume.end(), &conn),
+                                      shard.pendingResume.end());
+        }
+        
+        // Best effort for final words such as a protocol error
+        if (conn.writable && !conn.outQueue.empty()) {
+            flushConnection(conn);
+        }
+        
+        eraseOutput(conn, 0, conn.outQueue.size());
+        setBatching(conn, false);
+        shard.metrics.connectionsClosed.add();
+        shard.metrics.openConnections.sub();
+        
+        shard.poller.remove(clientSocket);
+        closesocket(clientSocket);
+        shard.connections.erase(clientSocket);
+    }
+    
+    // Connections are only destroyed between event batches so that events
+    // already collected for this iteration never point at freed state
+    void closePendingConnections(Shard& shard) {
+        while (!shard.pendingClose.empty()) {
+            Connection* conn = shard.pendingClose.back();
+            shard.pendingClose.pop_back();
+            closeConnection(*conn);
         }
     }
     
-    void sendMessageHistory(SOCKET clientSocket, const std::string& roomName) {
-        std::lock_guard<std::mutex> lock(roomsMutex);
-        auto it = rooms.find(roomName);
-        if (it != rooms.end()) {
-            std::string historyMsg = "\n=== Room History ===\n";
-            for (const auto& msg : it->second.messageHistory) {
-                historyMsg += msg + "\n";
+    void flushPendingConnections(Shard& shard) {
+        std::vector<Connection*>& batch = shard.flushBatch;
+        batch.swap(shard.pendingFlush);
+        for (Connection* conn : batch) {
+            conn->flushScheduled = false;
+            if (conn->closing || !conn->writable) {
+                continue;
+            }
+            if (conn->batching && conn->outQueueBytes < config.flushBytes) {
+                holdFlush(*conn);
+                continue;
             }
-            historyMsg += "=== End History ===\n";
-            send(clientSocket, historyMsg.c_str(), historyMsg.length(), 0);
+            flushConnection(*conn);
+        }
+        batch.clear();
+    }
+    
+    // Flush before closing: pendingFlush may name connections that are about
+    // to be destroyed, while closing can queue leave notices for others
+    void finishBatch(Shard& shard) {
+        while (!shard.pendingResume.empty() || !shard.pendingFlush.empty() || !shard.pendingClose.empty()) {
+            resumeSessions(shard);
+            flushPendingConnections(shard);
+            closePendingConnections(shard);
         }
     }
     
-    std::vector<std::string> getUsersInRoom(const std::string& roomName) {
-        std::lock_guard<std::mutex> lock(clientsMutex);
-        std::vector<std::string> users;
+    void adoptConnection(Shard& shard, SOCKET clientSocket) {
+        auto conn = std::make_unique<Connection>(clientSocket, &shard);
+        Connection& ref = *conn;
+        shard.connections[clientSocket] = std::move(conn);
+        if (!shard.poller.add(clientSocket, &ref)) {
+            shard.connections.erase(clientSocket);
+            closesocket(clientSocket);
+            return;
+        }
+        shard.metrics.connectionsAccepted.add();
+        shard.metrics.openConnections.add();
+        
+        sockaddr_in peer{};
+        socklen_t peerSize = sizeof(peer);
+        if (getpeername(clientSocket, (sockaddr*)&peer, &peerSize) == 0) {
+            ref.peerAddress = ntohl(peer.sin_addr.s_addr);
+        }
         
-        for (const auto& client : clients) {
-            if (client.connected && client.room == roomName) {
-                users.push_back(client.username);
+        ref.lastReceiveNs = ClockService::monotonicNanos();
+        ref.burstStartNs = shard.roundNs;
+        // Output is coalesced here rather than by Nagle's algorithm
+        setTcpNoDelay(clientSocket);
+        if (config.idleTimeoutSec > 0) {
+            enableTcpKeepalive(clientSocket, config.idleTimeoutSec);
+        }
+        ref.session = runSession(ref);
+    }
+    
+    // Accepts are rate limited per listener. Under RatePolicy::Delay the
+    // loop pauses and leaves connections in the kernel backlog until the
+    // bucket refills; under Shed they are accepted and closed at once.
+    void acceptConnections(Shard& shard) {
+        while (running) {
+            uint64_t waitNs;
+            uint64_t nowNs = ClockService::monotonicNanos();
+            bool allowed = shard.acceptBucket.tryTake(config.acceptRate, nowNs, waitNs);
+            if (!allowed && config.ratePolicy == RatePolicy::Delay) {
+                shard.metrics.rateDelayed[(size_t)RateScope::Accept].add();
+                shard.timers.arm(shard.acceptTimer, nowNs, waitNs);
+                return;
+            }
+            
+            sockaddr_in clientAddr;
+            socklen_t clientSize = sizeof(clientAddr);
+            SOCKET clientSocket = accept(shard.listenSocket, (sockaddr*)&clientAddr, &clientSize);
+            
+            if (clientSocket == INVALID_SOCKET) {
+                int error = WSAGetLastError();
+                if (error == WSAEINTR) {
+                    continue;
+                }
+                if (!socketWouldBlock(error)) {
+                    logMessage(LogLevel::Error, "Accept error: ", error);
+                }
+                return;
+            }
+            
+            if (!allowed) {
+                shard.metrics.rateShed[(size_t)RateScope::Accept].add();
+                closesocket(clientSocket);
+                continue;
+            }
+            
+            if (!setSocketNonBlocking(clientSocket)) {
+                closesocket(clientSocket);
+                continue;
+            }
+            
+            // Without SO_REUSEPORT only shard 0 listens; spread its
+            // connections round-robin over the other shards
+            Shard* target = &shard;
+            if (!reusePortSharding && shards.size() > 1) {
+                target = shards[nextAdoptShard++ % shards.size()].get();
+            }
+            
+            if (target == &shard) {
+                adoptConnection(shard, clientSocket);
+            }
+            else {
+                ShardMessage post;
+                post.kind = ShardMessage::Adopt;
+                post.socket = clientSocket;
+                target->inbox.push(std::move(post));
+                target->wakeup.notify();
             }
         }
-        return users;
     }
     
-    bool handleCommand(SOCKET clientSocket, const std::string& command, const std::string& username, const std::string& room) {
-        std::istringstream iss(command);
-        std::string cmd;
-        iss >> cmd;
+    void drainInbox(Shard& shard) {
+        shard.wakeup.drain();
         
-        if (cmd == "/list") {
-            auto users = getUsersInRoom(room);
-            std::string userList = "\n=== Users in room '" + room + "' ===\n";
-            for (const auto& user : users) {
-                userList += "- " + user + "\n";
+        ShardMessage post;
+        while (shard.inbox.pop(post)) {
+            if (post.kind == ShardMessage::Adopt) {
+                adoptConnection(shard, post.socket);
             }
-            userList += "Total: " + std::to_string(users.size()) + " users\n";
-            send(clientSocket, userList.c_str(), userList.length(), 0);
-            return true;
-        }
-        else if (cmd == "/rooms") {
-            std::lock_guard<std::mutex> lock(roomsMutex);
-            std::string roomList = "\n=== Available Rooms ===\n";
-            for (const auto& roomPair : rooms) {
-                roomList += "- " + roomPair.first + " (" + std::to_string(roomPair.second.clients.size()) + " users)\n";
+            else if (post.kind == ShardMessage::Direct) {
+                deliverDirect(shard, post.socket, post.recipient, post.message);
+            }
+            else {
+                startFanout(shard, post.room, std::move(post.members),
+                            FanoutJob::Message{std::move(post.message), SharedBuffer(), post.seq, post.socket,
+                                               post.receivedNs, std::move(post.completion)});
             }
-            roomList += "Total: " + std::to_string(rooms.size()) + " rooms\n";
-            send(clientSocket, roomList.c_str(), roomList.length(), 0);
-            return true;
-        }
-        else if (cmd == "/help") {
-            std::string help = "\n=== Available Commands ===\n";
-            help += "/list - Show users in current room\n";
-            help += "/rooms - Show all available rooms\n";
-            help += "/quit - Leave the chat\n";
-            help += "/help - Show this help message\n";
-            send(clientSocket, help.c_str(), help.length(), 0);
-            return true;
         }
-        
-        return false;
     }
     
+    void runShard(Shard& shard) {
+        std::vector<PollEvent> events;
+        currentShardMetrics() = &shard.metrics;
+        SlabPool::install(shard.slab);
+        
+        while (running && !shutdownRequested) {
+            int timeoutMs = !shard.fanout.empty() ? 0 : shard.timers.size() > 0 ? TIMER_TICK_MS : 500;
+            if (!shard.heldFlush.empty()) {
+                uint64_t nowNs = ClockService::monotonicNanos();
+                uint64_t waitNs = shard.heldFlushDueNs > nowNs ? shard.heldFlushDueNs - nowNs : 0;
+                timeoutMs = std::min(timeoutMs, (int)((waitNs + 999999) / 1000000));
+            }
+            shard.poller.wait(events, timeoutMs);
+            clockService.refresh();
+            shard.roundNs = ClockService::monotonicNanos();
+            shard.timers.advance(shard.roundNs, [this, &shard](TimerWheel::Timer& timer) {
+                if (timer.owner == &shard) {
+                    acceptConnections(shard);
+                    return;
+                }
+                wakeSession(*static_cast<Connection*>(timer.owner), WAKE_TIMER);
+            });
+            
+            for (const PollEvent& event : events) {
+                if (event.tag == nullptr) {
+                    acceptConnections(shard);
+                    continue;
+                }
+                if (event.tag == &shard.wakeup) {
+                    drainInbox(shard);
+                    continue;
+                }
+                
+                Connection& conn = *static_cast<Connection*>(event.tag);
+                if (event.writable && !conn.closing) {
+                    conn.writable = true;
+                    flushConnection(conn);
+                }
+                if (event.readable && !conn.closing) {
+                    wakeSession(conn, WAKE_READABLE);
+                }
+            }
+            
+            continueFanout(shard);
+            flushHeldConnections(shard);
+            finishBatch(shard);
+        }
+    }
+
 public:
-    ChatServer() : serverSocket(INVALID_SOCKET), running(false) {}
+    explicit ChatServer(const ServerConfig& cfg = ServerConfig())
+        : config(cfg), busyOutput(busyOutputFor(cfg)), reusePortSharding(false), nextAdoptShard(0),
+          users(cfg.offlineMessages, cfg.offlineBytes), roomBytes(0), roomsEvicted(0), roomsLoaded(0),
+          roomsVersion(0), membersVersion(0), roomsReplyVersion(0), roomsReplyMembers(0), roomsReplyNs(0),
+          running(false), initialized(false), metricsSocket(INVALID_SOCKET) {}
     
     ~ChatServer() {
         stop();
@@ -154,197 +2492,382 @@ public:
             std::cerr << "WSAStartup failed\n";
             return false;
         }
+        initialized = true;
         
-        serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (serverSocket == INVALID_SOCKET) {
-            std::cerr << "Socket creation failed\n";
-            WSACleanup();
-            return false;
-        }
-        
-        sockaddr_in serverAddr{};
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(8080);
-        serverAddr.sin_addr.s_addr = INADDR_ANY;
-        
-        if (bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-            std::cerr << "Bind failed\n";
-            closesocket(serverSocket);
-            WSACleanup();
-            return false;
-        }
+        raiseFileDescriptorLimit();
         
-        if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
-            std::cerr << "Listen failed\n";
-            closesocket(serverSocket);
-            WSACleanup();
-            return false;
+        size_t shardCount = config.shards;
+        if (shardCount == 0) {
+            shardCount = std::max(1u, std::thread::hardware_concurrency());
         }
+#ifdef __linux__
+        reusePortSharding = shardCount > 1;
+#endif
         
-        return true;
-    }
-    
-    void handleClient(SOCKET clientSocket) {
-        char buffer[1024];
-        int bytesReceived;
-        std::string username, room;
-        bool userInfoReceived = false;
-        
-        // Send welcome message
-        std::string welcome = "Welcome to the chat server!\n";
-        welcome += "Please send your username and room in format: USERNAME|ROOM\n";
-        send(clientSocket, welcome.c_str(), welcome.length(), 0);
-        
-        while (running) {
-            bytesReceived = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+        for (size_t i = 0; i < shardCount; ++i) {
+            auto shard = std::make_unique<Shard>(i);
+            if (!shard->poller.valid() || !shard->wakeup.open() ||
+                !shard->poller.add(shard->wakeup.socketHandle(), &shard->wakeup)) {
+                std::cerr << "Event poller creation failed\n";
+                return false;
+            }
             
-            if (bytesReceived > 0) {
-                buffer[bytesReceived] = '\0';
-                std::string message(buffer);
-                
-                if (!userInfoReceived) {
-                    // Parse username and room
-                    size_t pos = message.find('|');
-                    if (pos != std::string::npos) {
-                        username = message.substr(0, pos);
-                        room = message.substr(pos + 1);
-                        
-                        // Remove newline characters
-                        username.erase(std::remove(username.begin(), username.end(), '\n'), username.end());
-                        username.erase(std::remove(username.begin(), username.end(), '\r'), username.end());
-                        room.erase(std::remove(room.begin(), room.end(), '\n'), room.end());
-                        room.erase(std::remove(room.begin(), room.end(), '\r'), room.end());
-                        
-                        if (username.empty()) username = "Anonymous";
-                        if (room.empty()) room = "General";
-                        
-                        // Add client to our list
-                        {
-                            std::lock_guard<std::mutex> lock(clientsMutex);
-                            clients.emplace_back(clientSocket);
-                            clients.back().username = username;
-                            clients.back().room = room;
-                        }
-                        
-                        addToRoom(room, clientSocket);
-                        userInfoReceived = true;
-                        
-                        // Send room history
-                        sendMessageHistory(clientSocket, room);
-                        
-                        // Notify others in room
-                        std::string joinMsg = "[" + getCurrentTime() + "] " + username + " joined the room '" + room + "'";
-                        addMessageToRoom(room, joinMsg);
-                        sendMessageToRoom(room, joinMsg, clientSocket);
-                        
-                        std::cout << "Client " << username << " joined room " << room << std::endl;
-                    }
-                }
-                else {
-                    // Handle regular messages and commands
-                    if (message[0] == '/') {
-                        if (!handleCommand(clientSocket, message, username, room)) {
-                            std::string errorMsg = "Unknown command. Type /help for available commands.";
-                            send(clientSocket, errorMsg.c_str(), errorMsg.length(), 0);
-                        }
-                    }
-                    else {
-                        // Regular message
-                        std::string fullMessage = "[" + getCurrentTime() + "] " + username + ": " + message;
-                        addMessageToRoom(room, fullMessage);
-                        sendMessageToRoom(room, fullMessage, clientSocket);
-                        std::cout << "[" << room << "] " << fullMessage << std::endl;
-                    }
+            // The listening socket is registered with a null tag
+            if (i == 0 || reusePortSharding) {
+                shard->listenSocket = createListenSocket(config.port, INADDR_ANY, reusePortSharding);
+                if (shard->listenSocket == INVALID_SOCKET ||
+                    !shard->poller.add(shard->listenSocket, nullptr)) {
+                    return false;
                 }
             }
-            else if (bytesReceived == 0) {
-                std::cout << "Client disconnected\n";
-                break;
+            shards.push_back(std::move(shard));
+        }
+        
+        if (!config.dataDir.empty()) {
+            uint64_t startNs = ClockService::monotonicNanos();
+            roomLogs = std::make_unique<RoomLogStore>(config.dataDir, config.roomLog);
+            if (!roomLogs->start()) {
+                std::cerr << "Cannot use data directory " << config.dataDir << "\n";
+                return false;
             }
-            else {
-                int error = WSAGetLastError();
-                if (error != WSAEWOULDBLOCK) {
-                    std::cout << "Client error: " << error << std::endl;
+            // Load rooms idle while they fit the budget; the rest wait for a join
+            std::vector<std::string> persisted = roomLogs->discoverRooms();
+            size_t loaded = 0;
+            for (const std::string& name : persisted) {
+                if (roomBytes.load(std::memory_order_relaxed) >= config.roomMemory) {
                     break;
                 }
+                releaseRoom(*acquireRoom(name));
+                ++loaded;
             }
+            std::cout << "Loaded " << loaded << " of " << persisted.size() << " room log(s) from " << config.dataDir << " in "
+                      << (double)(ClockService::monotonicNanos() - startNs) / 1e6 << " ms\n";
         }
         
-        // Cleanup
-        if (userInfoReceived) {
-            removeFromRoom(room, clientSocket);
-            
-            // Notify others in room
-            std::string leaveMsg = "[" + getCurrentTime() + "] " + username + " left the room";
-            addMessageToRoom(room, leaveMsg);
-            sendMessageToRoom(room, leaveMsg);
-            
-            // Remove from clients list
-            {
-                std::lock_guard<std::mutex> lock(clientsMutex);
-                clients.erase(
-                    std::remove_if(clients.begin(), clients.end(),
-                        [clientSocket](const Client& c) { return c.socket == clientSocket; }),
-                    clients.end()
-                );
+        if (config.metricsPort != 0) {
+            metricsSocket = createListenSocket(config.metricsPort, INADDR_LOOPBACK, false);
+            if (metricsSocket == INVALID_SOCKET) {
+                return false;
             }
         }
         
-        closesocket(clientSocket);
+        return true;
     }
     
     void run() {
         if (!initialize()) {
+            stop();
             return;
         }
         
         running = true;
-        std::cout << "Chat server listening on port 8080...\n";
+        std::cout << "Chat server listening on port " << config.port << "...\n";
+        std::cout << "Running " << shards.size() << " reactor thread(s)"
+                  << (reusePortSharding ? " with SO_REUSEPORT listeners" : "") << "\n";
+        if (metricsSocket != INVALID_SOCKET) {
+            std::cout << "Metrics at http://127.0.0.1:" << config.metricsPort << "/metrics\n";
+            metricsThread = std::thread(&ChatServer::runMetricsEndpoint, this);
+        }
         std::cout << "Press Ctrl+C to stop the server\n\n";
         
-        while (running) {
-            sockaddr_in clientAddr;
-            int clientSize = sizeof(clientAddr);
-            SOCKET clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, &clientSize);
-            
-            if (clientSocket != INVALID_SOCKET) {
-                std::thread(&ChatServer::handleClient, this, clientSocket).detach();
-            }
+        // Shard 0 runs on the calling thread
+        for (size_t i = 1; i < shards.size(); ++i) {
+            Shard& shard = *shards[i];
+            shard.thread = std::thread(&ChatServer::runShard, this, std::ref(shard));
         }
+        runShard(*shards[0]);
+        
+        stop();
     }
     
     void stop() {
         running = false;
-        if (serverSocket != INVALID_SOCKET) {
-            closesocket(serverSocket);
-            serverSocket = INVALID_SOCKET;
+        for (auto& shard : shards) {
+            shard->wakeup.notify();
+        }
+        for (auto& shard : shards) {
+            if (shard->thread.joinable()) {
+                shard->thread.join();
+            }
+        }
+        if (metricsThread.joinable()) {
+            metricsThread.join();
+        }
+        if (roomLogs) {
+            roomLogs->stop();
+        }
+        if (metricsSocket != INVALID_SOCKET) {
+            closesocket(metricsSocket);
+            metricsSocket = INVALID_SOCKET;
         }
         
-        // Close all client connections
-        {
-            std::lock_guard<std::mutex> lock(clientsMutex);
-            for (auto& client : clients) {
-                closesocket(client.socket);
+        for (auto& shard : shards) {
+            if (shard->listenSocket != INVALID_SOCKET) {
+                shard->poller.remove(shard->listenSocket);
+                closesocket(shard->listenSocket);
+                shard->listenSocket = INVALID_SOCKET;
+            }
+            
+            // Close all client connections
+            for (auto& entry : shard->connections) {
+                shard->poller.remove(entry.first);
+                closesocket(entry.first);
+            }
+            shard->connections.clear();
+            shard->pendingClose.clear();
+            shard->pendingFlush.clear();
+            shard->heldFlush.clear();
+            
+            // Sockets handed off but never adopted
+            ShardMessage post;
+            while (shard->inbox.pop(post)) {
+                if (post.kind == ShardMessage::Adopt) {
+                    closesocket(post.socket);
+                }
             }
-            clients.clear();
+        }
+        // Let queued log lines come out before the summary
+        AsyncLogger::instance().flush();
+        if (initialized && !shards.empty()) {
+            std::cout << statsText();
+        }
+        shards.clear();
+        
+        if (initialized) {
+            std::cout << "Slow consumers: " << slowConsumerStats.droppedMessages.load() << " messages dropped, "
+                      << slowConsumerStats.disconnects.load() << " disconnected, "
+                      << slowConsumerStats.coalesced.load() << " backlogs coalesced\n";
+            std::cout << "Log: " << AsyncLogger::instance().writtenCount() << " records written, "
+                      << AsyncLogger::instance().droppedCount() << " dropped, "
+                      << AsyncLogger::instance().shedCount() << " chat lines shed\n";
         }
         
-        WSACleanup();
+        clients.clear();
+        
+        if (initialized) {
+            initialized = false;
+            WSACleanup();
+        }
     }
 };
 
-int main() {
-    ChatServer server;
+static void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [--port N] [--shards N]\n"
+              << "       [--queue-limit MESSAGES] [--queue-bytes BYTES]\n"
+              << "       [--slow-consumer drop-oldest|disconnect|coalesce]\n"
+              << "       [--listen-backlog N] [--max-replays N] [--fanout-slice N]\n"
+              << "       [--flush-window MS] [--flush-bytes BYTES] [--flush-busy N]\n"
+              << "       [--handshake-timeout SEC] [--idle-timeout SEC] [--ping-timeout SEC]\n"
+              << "       [--conn-rate R[:BURST]] [--room-rate R[:BURST]] [--ip-rate R[:BURST]]\n"
+              << "       [--accept-rate R[:BURST]] [--rate-policy shed|delay]\n"
+              << "       [--history MESSAGES] [--history-bytes BYTES] [--room-history ROOM=MESSAGES]...\n"
+              << "       [--room-memory BYTES]\n"
+              << "       [--metrics-port N] [--log-level debug|info|warn|error] [--log-file PATH]\n"
+              << "       [--log-chat-sample N] [--data-dir DIR] [--segment-bytes BYTES]\n"
+              << "       [--offline-messages N] [--offline-bytes BYTES]\n"
+              << "       [--fsync-interval MS] [--fsync-bytes BYTES]\n";
+}
+
+// "RATE[:BURST]" per second; the burst defaults to one second's worth
+static RateLimit parseRateLimit(const char* value) {
+    char* end = nullptr;
+    double rate = std::strtod(value, &end);
+    double burst = rate;
+    if (*end == ':') {
+        burst = std::strtod(end + 1, nullptr);
+    }
+    return RateLimit(rate, burst);
+}
+
+static bool parseArguments(int argc, char* argv[], ServerConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--port") {
+            config.port = (unsigned short)std::atoi(value);
+        }
+        else if (arg == "--shards") {
+            config.shards = (size_t)std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--queue-limit") {
+            config.queueLimit = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--queue-bytes") {
+            config.queueBytes = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--listen-backlog") {
+            config.listenBacklog = std::max(1, std::atoi(value));
+        }
+        else if (arg == "--offline-messages") {
+            config.offlineMessages = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--offline-bytes") {
+            config.offlineBytes = std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--fanout-slice") {
+            config.fanoutSlice = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--flush-window") {
+            config.flushWindowMs = (unsigned)std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--flush-bytes") {
+            config.flushBytes = std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--flush-busy") {
+            config.flushBusy = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--max-replays") {
+            config.maxReplays = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--handshake-timeout") {
+            config.handshakeTimeoutSec = (unsigned)std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--idle-timeout") {
+            config.idleTimeoutSec = (unsigned)std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--ping-timeout") {
+            config.pingTimeoutSec = std::max(1u, (unsigned)std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--conn-rate") {
+            config.connectionRate = parseRateLimit(value);
+        }
+        else if (arg == "--room-rate") {
+            config.roomRate = parseRateLimit(value);
+        }
+        else if (arg == "--ip-rate") {
+            config.addressRate = parseRateLimit(value);
+        }
+        else if (arg == "--accept-rate") {
+            config.acceptRate = parseRateLimit(value);
+        }
+        else if (arg == "--rate-policy") {
+            std::string policy = value;
+            if (policy == "shed") {
+                config.ratePolicy = RatePolicy::Shed;
+            }
+            else if (policy == "delay") {
+                config.ratePolicy = RatePolicy::Delay;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (arg == "--history") {
+            config.historyMessages = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--room-memory") {
+            config.roomMemory = std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--history-bytes") {
+            config.historyBytes = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--room-history") {
+            std::string spec = value;
+            size_t eq = spec.rfind('=');
+            if (eq == std::string::npos || eq == 0) {
+                return false;
+            }
+            config.roomHistoryMessages[spec.substr(0, eq)] = std::max<size_t>(1, std::strtoul(spec.c_str() + eq + 1, nullptr, 10));
+        }
+        else if (arg == "--log-level") {
+            std::string level = value;
+            if (level == "debug") {
+                config.logLevel = LogLevel::Debug;
+            }
+            else if (level == "info") {
+                config.logLevel = LogLevel::Info;
+            }
+            else if (level == "warn") {
+                config.logLevel = LogLevel::Warn;
+            }
+            else if (level == "error") {
+                config.logLevel = LogLevel::Error;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (arg == "--log-file") {
+            config.logFile = value;
+        }
+        else if (arg == "--log-chat-sample") {
+            config.chatLogSample = (uint32_t)std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--data-dir") {
+            config.dataDir = value;
+        }
+        else if (arg == "--segment-bytes") {
+            config.roomLog.segmentBytes = std::max<size_t>(4096, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--fsync-interval") {
+            config.roomLog.fsyncIntervalMs = (unsigned)std::strtoul(value, nullptr, 10);
+        }
+        else if (arg == "--fsync-bytes") {
+            config.roomLog.fsyncBytes = std::max<size_t>(1, std::strtoul(value, nullptr, 10));
+        }
+        else if (arg == "--metrics-port") {
+            config.metricsPort = (unsigned short)std::atoi(value);
+        }
+        else if (arg == "--slow-consumer") {
+            std::string policy = value;
+            if (policy == "drop-oldest") {
+                config.slowConsumerPolicy = SlowConsumerPolicy::DropOldest;
+            }
+            else if (policy == "disconnect") {
+                config.slowConsumerPolicy = SlowConsumerPolicy::DropConnection;
+            }
+            else if (policy == "coalesce") {
+                config.slowConsumerPolicy = SlowConsumerPolicy::Coalesce;
+            }
+            else {
+                return false;
+            }
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    ServerConfig config;
+    if (!parseArguments(argc, argv, config)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    
+    AsyncLogger& logger = AsyncLogger::instance();
+    logger.setLevel(config.logLevel);
+    logger.setChatSampling(config.chatLogSample);
+    if (!config.logFile.empty() && !logger.openFile(config.logFile)) {
+        std::cerr << "Cannot open log file " << config.logFile << "\n";
+        return 1;
+    }
+    logger.start();
+    
+    ChatServer server(config);
     
     // Handle Ctrl+C gracefully
+#ifdef _WIN32
     SetConsoleCtrlHandler([](DWORD ctrlType) -> BOOL {
         if (ctrlType == CTRL_C_EVENT) {
             std::cout << "\nShutting down server...\n";
+            shutdownRequested = true;
             return TRUE;
         }
         return FALSE;
     }, TRUE);
+#else
+    std::signal(SIGPIPE, SIG_IGN);
+    std::signal(SIGINT, [](int) { shutdownRequested = true; });
+    std::signal(SIGTERM, [](int) { shutdownRequested = true; });
+#endif
     
     server.run();
+    logger.stop();
     return 0;
 }
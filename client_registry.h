@@ -0,0 +1,133 @@
+#ifndef CLIENT_REGISTRY_H
+#define CLIENT_REGISTRY_H
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "windows_sockets.h"
+#include "metrics.h"
+#include "name_table.h"
+
+// Every connected user, indexed by socket and by room. Registering,
+// unregistering and looking a user up are O(1); listing a room walks only
+// that room's members, never the whole server. A socket is indexed under
+// every room it has joined; /list is rendered from that index. Routing by
+// username is UserDirectory's job. Names are interned (see NameTable); the
+// caller's connection holds the references that keep them valid.
+class ClientRegistry {
+public:
+    struct Client {
+        NameId username;
+        std::string_view name;       // the username's interned text
+        std::vector<NameId> rooms;   // in the order they were joined
+    };
+
+private:
+    mutable std::mutex mutex;
+    std::unordered_map<SOCKET, Client> bySocket;
+    std::unordered_map<NameId, std::unordered_set<SOCKET>> byRoom;
+
+    // Drop `socket` from one secondary index, and the key once it is empty
+    static void unindex(std::unordered_map<NameId, std::unordered_set<SOCKET>>& index, NameId key, SOCKET socket) {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return;
+        }
+        it->second.erase(socket);
+        if (it->second.empty()) {
+            index.erase(it);
+        }
+    }
+
+    // Drop every index entry of a registered socket; caller holds the lock
+    void unindexClient(SOCKET socket, const Client& client) {
+        for (NameId room : client.rooms) {
+            unindex(byRoom, room, socket);
+        }
+    }
+
+public:
+    // Replaces any earlier registration of the same socket, rooms included
+    void add(SOCKET socket, const InternedName& username) {
+        TimedLockGuard lock(mutex, LockClass::ClientRegistry);
+        auto existing = bySocket.find(socket);
+        if (existing != bySocket.end()) {
+            unindexClient(socket, existing->second);
+        }
+        bySocket[socket] = Client{username.id(), username.str(), {}};
+    }
+
+    void joinRoom(SOCKET socket, NameId room) {
+        TimedLockGuard lock(mutex, LockClass::ClientRegistry);
+        auto it = bySocket.find(socket);
+        if (it == bySocket.end()) {
+            return;
+        }
+        it->second.rooms.push_back(room);
+        byRoom[room].insert(socket);
+    }
+
+    void leaveRoom(SOCKET socket, NameId room) {
+        TimedLockGuard lock(mutex, LockClass::ClientRegistry);
+        auto it = bySocket.find(socket);
+        if (it == bySocket.end()) {
+            return;
+        }
+        std::vector<NameId>& rooms = it->second.rooms;
+        rooms.erase(std::remove(rooms.begin(), rooms.end(), room), rooms.end());
+        unindex(byRoom, room, socket);
+    }
+
+    void remove(SOCKET socket) {
+        TimedLockGuard lock(mutex, LockClass::ClientRegistry);
+        auto it = bySocket.find(socket);
+        if (it == bySocket.end()) {
+            return;
+        }
+        unindexClient(socket, it->second);
+        bySocket.erase(it);
+    }
+
+    void clear() {
+        TimedLockGuard lock(mutex, LockClass::ClientRegistry);
+        bySocket.clear();
+        byRoom.clear();
+    }
+
+    size_t size() const {
+        TimedLockGuard lock(mutex, LockClass::ClientRegistry);
+        return bySocket.size();
+    }
+
+    bool find(SOCKET socket, Client& out) const {
+        TimedLockGuard lock(mutex, LockClass::ClientRegistry);
+        auto it = bySocket.find(socket);
+        if (it == bySocket.end()) {
+            return false;
+        }
+        out = it->second;
+        return true;
+    }
+
+    // Usernames of a room's members, one per connection, in no particular
+    // order. Copied, since a member may disconnect once the lock is released.
+    std::vector<std::string> usersInRoom(NameId room) const {
+        TimedLockGuard lock(mutex, LockClass::ClientRegistry);
+        std::vector<std::string> users;
+        auto it = byRoom.find(room);
+        if (it == byRoom.end()) {
+            return users;
+        }
+        users.reserve(it->second.size());
+        for (SOCKET socket : it->second) {
+            users.emplace_back(bySocket.at(socket).name);
+        }
+        return users;
+    }
+};
+
+#endif // CLIENT_REGISTRY_H
@@ -0,0 +1,66 @@
+#ifndef CLOCK_SERVICE_H
+#define CLOCK_SERVICE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include "windows_sockets.h"
+
+// Timestamps for the message path. The "HH:MM:SS" wall-clock text is
+// formatted at most once per second by refresh() and published as one
+// 64-bit word, so readers get it with a single atomic load: no lock, no
+// localtime call and no allocation. monotonicNanos() is for measuring
+// latency and never goes backwards.
+class ClockService {
+private:
+    static const size_t TEXT_LENGTH = 8;   // "HH:MM:SS"
+
+    std::atomic<int64_t> formattedSecond;
+    std::atomic<uint64_t> packedText;
+
+public:
+    ClockService() : formattedSecond(-1), packedText(0) {
+        refresh();
+    }
+
+    // Reformat if the second has changed. Cheap enough to call on every
+    // event-loop iteration; concurrent callers at worst format twice.
+    void refresh() {
+        time_t now = time(0);
+        if (formattedSecond.load(std::memory_order_relaxed) == (int64_t)now) {
+            return;
+        }
+        struct tm timeinfo;
+        localtime_s(&timeinfo, &now);
+        char buffer[16];
+        strftime(buffer, sizeof(buffer), "%H:%M:%S", &timeinfo);
+        uint64_t packed = 0;
+        memcpy(&packed, buffer, TEXT_LENGTH);
+        packedText.store(packed, std::memory_order_release);
+        formattedSecond.store((int64_t)now, std::memory_order_relaxed);
+    }
+
+    // Append "HH:MM:SS" as of the last refresh()
+    void appendWallClock(std::string& out) const {
+        uint64_t packed = packedText.load(std::memory_order_acquire);
+        char text[TEXT_LENGTH];
+        memcpy(text, &packed, TEXT_LENGTH);
+        out.append(text, TEXT_LENGTH);
+    }
+
+    std::string wallClock() const {
+        std::string text;
+        appendWallClock(text);
+        return text;
+    }
+
+    static uint64_t monotonicNanos() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+#endif // CLOCK_SERVICE_H
@@ -0,0 +1,115 @@
+#ifndef COMMAND_TABLE_H
+#define COMMAND_TABLE_H
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <string_view>
+
+// Slash commands the server answers
+enum class CommandId {
+    List,
+    Rooms,
+    History,
+    Stats,
+    Help,
+    Join,
+    Leave,
+    Msg,
+    Unknown
+};
+
+struct CommandName {
+    std::string_view name;
+    CommandId id;
+};
+
+constexpr CommandName COMMAND_NAMES[] = {
+    {"/list", CommandId::List},
+    {"/rooms", CommandId::Rooms},
+    {"/history", CommandId::History},
+    {"/stats", CommandId::Stats},
+    {"/help", CommandId::Help},
+    {"/join", CommandId::Join},
+    {"/leave", CommandId::Leave},
+    {"/msg", CommandId::Msg},
+};
+
+const size_t COMMAND_SLOTS = 16;   // power of two
+
+// Length and second character are enough to tell the commands apart;
+// buildCommandTable() refuses to compile if a new name collides
+constexpr size_t commandHash(std::string_view name) {
+    return (name.size() * 4 + (uint8_t)name[1]) & (COMMAND_SLOTS - 1);
+}
+
+constexpr std::array<CommandName, COMMAND_SLOTS> buildCommandTable() {
+    std::array<CommandName, COMMAND_SLOTS> table{};
+    for (size_t i = 0; i < COMMAND_SLOTS; ++i) {
+        table[i] = CommandName{std::string_view(), CommandId::Unknown};
+    }
+    for (const CommandName& command : COMMAND_NAMES) {
+        size_t slot = commandHash(command.name);
+        if (table[slot].id != CommandId::Unknown) {
+            throw "command names collide in commandHash";
+        }
+        table[slot] = command;
+    }
+    return table;
+}
+
+constexpr std::array<CommandName, COMMAND_SLOTS> COMMAND_TABLE = buildCommandTable();
+
+// One hash and one comparison, no allocation
+inline CommandId lookupCommand(std::string_view name) {
+    if (name.size() < 2) {
+        return CommandId::Unknown;
+    }
+    const CommandName& entry = COMMAND_TABLE[commandHash(name)];
+    return entry.name == name ? entry.id : CommandId::Unknown;
+}
+
+// Splits a command line into whitespace-separated words. Words are views
+// into the line, so nothing is copied.
+class CommandLine {
+private:
+    std::string_view rest;
+
+    static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+public:
+    explicit CommandLine(std::string_view line) : rest(line) {}
+
+    // Empty once the words run out
+    std::string_view next() {
+        size_t start = 0;
+        while (start < rest.size() && isSpace(rest[start])) {
+            ++start;
+        }
+        size_t end = start;
+        while (end < rest.size() && !isSpace(rest[end])) {
+            ++end;
+        }
+        std::string_view word = rest.substr(start, end - start);
+        rest.remove_prefix(end);
+        return word;
+    }
+
+    // The rest of the line after the words taken so far, such as a
+    // message's text
+    std::string_view remainder() const {
+        size_t start = 0;
+        while (start < rest.size() && isSpace(rest[start])) {
+            ++start;
+        }
+        return rest.substr(start);
+    }
+
+    // A whole word as a decimal number; false if it is anything else
+    static bool parseNumber(std::string_view word, uint64_t& value) {
+        auto result = std::from_chars(word.data(), word.data() + word.size(), value);
+        return result.ec == std::errc() && result.ptr == word.data() + word.size();
+    }
+};
+
+#endif // COMMAND_TABLE_H
@@ -0,0 +1,269 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <utility>
+#include "windows_sockets.h"
+#include "slab_allocator.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define CHAT_USE_EPOLL 1
+#elif !defined(_WIN32)
+#include <poll.h>
+#endif
+
+// Readiness of one registered socket, identified by the tag given to add()
+struct PollEvent {
+    void* tag;
+    bool readable;
+    bool writable;
+};
+
+// Socket readiness multiplexer. Linux uses edge-triggered epoll, other
+// platforms fall back to poll()/WSAPoll(). Either way callers must keep
+// reading and writing until the call would block.
+class Poller {
+private:
+#ifdef CHAT_USE_EPOLL
+    int epollFd;
+    std::vector<epoll_event> ready;
+#else
+    std::vector<pollfd> fds;
+    std::vector<void*> tags;
+    std::unordered_map<SOCKET, size_t> indexBySocket;
+#endif
+
+public:
+#ifdef CHAT_USE_EPOLL
+    Poller() : epollFd(epoll_create1(EPOLL_CLOEXEC)), ready(256) {}
+
+    ~Poller() {
+        if (epollFd != -1) {
+            close(epollFd);
+        }
+    }
+
+    bool valid() const { return epollFd != -1; }
+
+    bool add(SOCKET s, void* tag) {
+        // Register for both directions once; edge triggering means we are
+        // only told about transitions, so write interest never has to change
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = tag;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, s, &ev) == 0;
+    }
+
+    void setWriteInterest(SOCKET, void*, bool) {}
+
+    void remove(SOCKET s) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, s, nullptr);
+    }
+
+    int wait(std::vector<PollEvent>& events, int timeoutMs) {
+        events.clear();
+        int count = epoll_wait(epollFd, ready.data(), (int)ready.size(), timeoutMs);
+        for (int i = 0; i < count; ++i) {
+            uint32_t e = ready[i].events;
+            events.push_back({
+                ready[i].data.ptr,
+                (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0,
+                (e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0
+            });
+        }
+        return count < 0 ? 0 : count;
+    }
+#else
+    Poller() {}
+
+    bool valid() const { return true; }
+
+    bool add(SOCKET s, void* tag) {
+        pollfd entry{};
+        entry.fd = s;
+        entry.events = POLLIN;
+        indexBySocket[s] = fds.size();
+        fds.push_back(entry);
+        tags.push_back(tag);
+        return true;
+    }
+
+    // poll() is level-triggered, so only ask for POLLOUT while output is pending
+    void setWriteInterest(SOCKET s, void*, bool enabled) {
+        auto it = indexBySocket.find(s);
+        if (it != indexBySocket.end()) {
+            fds[it->second].events = enabled ? (POLLIN | POLLOUT) : POLLIN;
+        }
+    }
+
+    void remove(SOCKET s) {
+        auto it = indexBySocket.find(s);
+        if (it == indexBySocket.end()) {
+            return;
+        }
+        size_t index = it->second;
+        indexBySocket.erase(it);
+        if (index != fds.size() - 1) {
+            fds[index] = fds.back();
+            tags[index] = tags.back();
+            indexBySocket[fds[index].fd] = index;
+        }
+        fds.pop_back();
+        tags.pop_back();
+    }
+
+    int wait(std::vector<PollEvent>& events, int timeoutMs) {
+        events.clear();
+#ifdef _WIN32
+        int count = fds.empty() ? (Sleep(timeoutMs), 0) : WSAPoll(fds.data(), (ULONG)fds.size(), timeoutMs);
+#else
+        int count = poll(fds.data(), (nfds_t)fds.size(), timeoutMs);
+#endif
+        for (size_t i = 0; i < fds.size() && count > 0; ++i) {
+            short e = fds[i].revents;
+            if (e == 0) {
+                continue;
+            }
+            events.push_back({
+                tags[i],
+                (e & (POLLIN | POLLHUP | POLLERR)) != 0,
+                (e & (POLLOUT | POLLHUP | POLLERR)) != 0
+            });
+            --count;
+        }
+        return (int)events.size();
+    }
+#endif
+};
+
+// Lets other threads interrupt a Poller::wait(). Linux uses an eventfd;
+// elsewhere a UDP socket connected to itself, because WSAPoll only
+// accepts sockets.
+class WakeupChannel {
+private:
+    SOCKET handle;
+    std::atomic<bool> pending;
+
+public:
+    WakeupChannel() : handle(INVALID_SOCKET), pending(false) {}
+
+    ~WakeupChannel() {
+        if (handle != INVALID_SOCKET) {
+#ifdef CHAT_USE_EPOLL
+            close(handle);
+#else
+            closesocket(handle);
+#endif
+        }
+    }
+
+    bool open() {
+#ifdef CHAT_USE_EPOLL
+        handle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        return handle != INVALID_SOCKET;
+#else
+        handle = socket(AF_INET, SOCK_DGRAM, 0);
+        if (handle == INVALID_SOCKET) {
+            return false;
+        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addrLen = sizeof(addr);
+        return bind(handle, (sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR &&
+               getsockname(handle, (sockaddr*)&addr, &addrLen) != SOCKET_ERROR &&
+               connect(handle, (sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR &&
+               setSocketNonBlocking(handle);
+#endif
+    }
+
+    SOCKET socketHandle() const { return handle; }
+
+    // Only the first notify after a drain touches the kernel
+    void notify() {
+        if (pending.exchange(true, std::memory_order_acq_rel)) {
+            return;
+        }
+#ifdef CHAT_USE_EPOLL
+        uint64_t one = 1;
+        ssize_t ignored = write(handle, &one, sizeof(one));
+        (void)ignored;
+#else
+        char one = 1;
+        send(handle, &one, 1, 0);
+#endif
+    }
+
+    // Call before consuming whatever the notifier published
+    void drain() {
+        pending.store(false, std::memory_order_release);
+#ifdef CHAT_USE_EPOLL
+        uint64_t value;
+        while (read(handle, &value, sizeof(value)) > 0) {}
+#else
+        char buffer[64];
+        while (recv(handle, buffer, sizeof(buffer), 0) > 0) {}
+#endif
+    }
+};
+
+// Unbounded multi-producer, single-consumer queue (Vyukov). push() is
+// wait-free; pop() must only ever be called from the owning thread. Nodes
+// come from the pushing thread's SlabPool.
+template <typename T>
+class MpscQueue {
+private:
+    struct Node {
+        std::atomic<Node*> next;
+        T value;
+
+        static void* operator new(size_t size) { return SlabPool::allocate(size); }
+        static void operator delete(void* memory, size_t size) { SlabPool::free(memory, size); }
+
+        Node() : next(nullptr) {}
+        explicit Node(T&& v) : next(nullptr), value(std::move(v)) {}
+    };
+
+    std::atomic<Node*> head;
+    Node* tail;
+
+public:
+    MpscQueue() {
+        Node* stub = new Node();
+        head.store(stub, std::memory_order_relaxed);
+        tail = stub;
+    }
+
+    ~MpscQueue() {
+        T discarded;
+        while (pop(discarded)) {}
+        delete tail;
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T value) {
+        Node* node = new Node(std::move(value));
+        Node* prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    bool pop(T& out) {
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            return false;
+        }
+        out = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+};
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,138 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+
+// Log-linear histogram in the style of HdrHistogram: values below 64 get
+// an exact bucket, larger values are split into 32 sub-buckets per power
+// of two, so any recorded value is reported within about 3%. Recording is
+// a couple of shifts and one relaxed store, with no allocation.
+//
+// One thread records; any thread may read concurrently and sees a
+// consistent-enough view for percentiles.
+class LatencyHistogram {
+private:
+    static const unsigned SUB_BUCKET_BITS = 5;
+    static const uint64_t SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+    static const size_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS) * SUB_BUCKETS + SUB_BUCKETS;
+
+    std::atomic<uint64_t> counts[BUCKET_COUNT];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> maxValue;
+
+    static unsigned highestBit(uint64_t value) {
+        unsigned bit = 0;
+        while (value >>= 1) {
+            ++bit;
+        }
+        return bit;
+    }
+
+    static size_t indexFor(uint64_t value) {
+        if (value < 2 * SUB_BUCKETS) {
+            return (size_t)value;
+        }
+        unsigned shift = highestBit(value) - SUB_BUCKET_BITS;
+        return (size_t)(shift * SUB_BUCKETS + (value >> shift));
+    }
+
+    // Largest value that lands in bucket `index`
+    static uint64_t upperBound(size_t index) {
+        if (index < 2 * SUB_BUCKETS) {
+            return index;
+        }
+        unsigned shift = (unsigned)(index / SUB_BUCKETS) - 1;
+        uint64_t mantissa = index - shift * SUB_BUCKETS;
+        return (mantissa << shift) + ((uint64_t)1 << shift) - 1;
+    }
+
+    static void bump(std::atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+public:
+    LatencyHistogram() {
+        reset();
+    }
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    // Only from the recording thread
+    void record(uint64_t value) {
+        bump(counts[indexFor(value)], 1);
+        bump(total, 1);
+        bump(sum, value);
+        if (value > maxValue.load(std::memory_order_relaxed)) {
+            maxValue.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    void reset() {
+        for (auto& count : counts) {
+            count.store(0, std::memory_order_relaxed);
+        }
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        maxValue.store(0, std::memory_order_relaxed);
+    }
+
+    // Add another histogram's samples; only from this one's recording thread
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            uint64_t count = other.counts[i].load(std::memory_order_relaxed);
+            if (count != 0) {
+                bump(counts[i], count);
+            }
+        }
+        bump(total, other.count());
+        bump(sum, other.sum.load(std::memory_order_relaxed));
+        if (other.max() > max()) {
+            maxValue.store(other.max(), std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return maxValue.load(std::memory_order_relaxed); }
+
+    double mean() const {
+        uint64_t n = count();
+        return n == 0 ? 0.0 : (double)sum.load(std::memory_order_relaxed) / (double)n;
+    }
+
+    // Smallest recorded bucket bound covering `quantile` (0..1) of samples
+    uint64_t percentile(double quantile) const {
+        uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        uint64_t target = (uint64_t)(quantile * (double)n);
+        if (target == 0) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                uint64_t bound = upperBound(i);
+                return bound < max() ? bound : max();
+            }
+        }
+        return max();
+    }
+
+    // fn(upperBound, count) for every non-empty bucket, ascending
+    template <typename Fn>
+    void forEachBucket(Fn&& fn) const {
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            uint64_t count = counts[i].load(std::memory_order_relaxed);
+            if (count != 0) {
+                fn(upperBound(i), count);
+            }
+        }
+    }
+};
+
+#endif // LATENCY_HISTOGRAM_H
@@ -0,0 +1,129 @@
+#ifndef MESSAGE_HISTORY_H
+#define MESSAGE_HISTORY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+// Fixed-capacity ring of a room's most recent messages. Message bytes live
+// back to back in one circular byte slab and a parallel ring of entries
+// records where each message starts, so appending is O(1) and never
+// shifts or allocates per message. Each message gets the next sequence
+// number, which lets readers resume from the last one they saw.
+class MessageHistory {
+private:
+    struct Entry {
+        uint64_t seq;
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    std::vector<Entry> entries;   // ring, oldest at `first`
+    size_t first;
+    size_t count;
+    std::vector<char> bytes;      // grows on demand up to byteCapacity
+    size_t byteCapacity;
+    size_t head;                  // next write offset in `bytes`
+    uint64_t nextSeq;
+
+    const Entry& entryAt(size_t i) const {
+        return entries[(first + i) % entries.size()];
+    }
+
+    void evictOldest() {
+        first = (first + 1) % entries.size();
+        --count;
+    }
+
+public:
+    MessageHistory(size_t maxMessages = 100, size_t maxBytes = 64 * 1024)
+        : entries(std::max<size_t>(1, maxMessages)), first(0), count(0),
+          byteCapacity(std::max<size_t>(1, maxBytes)), head(0), nextSeq(1) {}
+
+    size_t size() const { return count; }
+    size_t capacity() const { return entries.size(); }
+    size_t bytesReserved() const { return bytes.capacity() + entries.size() * sizeof(Entry); }
+
+    // Sequence number the next appended message will get
+    uint64_t nextSequence() const { return nextSeq; }
+
+    // Sequence number of the oldest retained message; nextSequence() if empty
+    uint64_t firstSequence() const { return count > 0 ? entryAt(0).seq : nextSeq; }
+
+    // Continue numbering from `seq`, e.g. before reloading persisted
+    // history. Ignored once the history holds messages.
+    void resetSequence(uint64_t seq) {
+        if (count == 0) {
+            nextSeq = seq;
+        }
+    }
+
+    // Messages longer than the slab are truncated to fit
+    uint64_t append(std::string_view message) {
+        size_t length = std::min(message.size(), byteCapacity);
+
+        if (count == entries.size()) {
+            evictOldest();
+        }
+        if (count == 0) {
+            head = 0;
+        }
+
+        // Never split a message across the end of the slab: evict whatever
+        // sits in the unused tail and start again from the beginning
+        if (head + length > byteCapacity) {
+            while (count > 0 && entryAt(0).offset >= head) {
+                evictOldest();
+            }
+            head = 0;
+        }
+        // Evict the oldest messages the new one would overwrite
+        while (count > 0 && entryAt(0).offset >= head && entryAt(0).offset < head + length) {
+            evictOldest();
+        }
+
+        if (head + length > bytes.size()) {
+            bytes.resize(std::min(byteCapacity, std::max(head + length, bytes.size() * 2)));
+        }
+        if (length > 0) {
+            memcpy(&bytes[head], message.data(), length);
+        }
+
+        Entry& entry = entries[(first + count) % entries.size()];
+        entry.seq = nextSeq++;
+        entry.offset = (uint32_t)head;
+        entry.length = (uint32_t)length;
+        ++count;
+        head += length;
+        return entry.seq;
+    }
+
+    // fn(seq, message) for the newest `limit` messages, oldest first
+    template <typename Fn>
+    void forEachLast(size_t limit, Fn&& fn) const {
+        size_t start = count > limit ? count - limit : 0;
+        for (size_t i = start; i < count; ++i) {
+            const Entry& entry = entryAt(i);
+            fn(entry.seq, std::string_view(bytes.data() + entry.offset, entry.length));
+        }
+    }
+
+    // fn(seq, message) for up to `limit` retained messages with a sequence
+    // number greater than `seq`, oldest first
+    template <typename Fn>
+    void forEachSince(uint64_t seq, Fn&& fn, size_t limit = SIZE_MAX) const {
+        size_t skip = 0;
+        if (count > 0 && seq >= entryAt(0).seq) {
+            skip = std::min<uint64_t>(count, seq - entryAt(0).seq + 1);
+        }
+        size_t end = count - skip > limit ? skip + limit : count;
+        for (size_t i = skip; i < end; ++i) {
+            const Entry& entry = entryAt(i);
+            fn(entry.seq, std::string_view(bytes.data() + entry.offset, entry.length));
+        }
+    }
+};
+
+#endif // MESSAGE_HISTORY_H
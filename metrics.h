@@ -0,0 +1,185 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include "clock_service.h"
+#include "latency_histogram.h"
+#include "rate_limiter.h"
+
+// Counters and gauges are kept per shard and only ever written by the
+// shard's own thread, so an update is a plain relaxed load and store on a
+// cache line no other core writes. Readers (/stats, the Prometheus
+// endpoint) sum the shards. Each shard's block is cache-line aligned so
+// neighbouring shards never share a line.
+
+enum class LockClass {
+    RoomDirectory,
+    RoomHistory,
+    RoomMembers,
+    ClientRegistry,
+    NameTable,
+    UserDirectory,
+    Count
+};
+
+inline const char* lockClassName(LockClass lock) {
+    switch (lock) {
+        case LockClass::RoomDirectory: return "room_directory";
+        case LockClass::RoomHistory: return "room_history";
+        case LockClass::RoomMembers: return "room_members";
+        case LockClass::ClientRegistry: return "client_registry";
+        case LockClass::NameTable: return "name_table";
+        case LockClass::UserDirectory: return "user_directory";
+        default: return "unknown";
+    }
+}
+
+const size_t LOCK_CLASS_COUNT = (size_t)LockClass::Count;
+
+// Single-writer counter; safe to read from any thread
+class Counter {
+private:
+    std::atomic<uint64_t> value;
+
+public:
+    Counter() : value(0) {}
+
+    void add(uint64_t amount = 1) {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    void sub(uint64_t amount = 1) {
+        value.store(value.load(std::memory_order_relaxed) - amount, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+struct alignas(64) ShardMetrics {
+    Counter connectionsAccepted;
+    Counter connectionsClosed;
+    Counter openConnections;       // gauge
+    Counter messagesReceived;      // chat messages from clients
+    Counter messagesQueued;        // deliveries queued to clients
+    Counter bytesReceived;
+    Counter bytesSent;
+    Counter outputWrites;          // send calls that wrote queued output
+    Counter flushesHeld;           // flushes put off until the shard's flush window
+    Counter batchingConnections;   // gauge: connections flushing in batches
+    Counter queuedMessages;        // gauge: outbound queue depth
+    Counter queuedBytes;           // gauge
+    Counter replaysActive;         // gauge: history replays streaming
+    Counter replaysDeferred;       // replays that had to wait for a slot
+    Counter pingsSent;
+    Counter handshakeTimeouts;     // closed before sending USERNAME|ROOM
+    Counter idleTimeouts;          // closed for not answering a ping
+    Counter directSent;            // /msg delivered to a connected user
+    Counter directStored;          // /msg buffered for a user who is offline
+    Counter directRefused;         // /msg for an offline user with the buffer full
+    Counter fanoutDeferred;        // room messages that waited in the fan-out queue
+    Counter rateShed[RATE_SCOPE_COUNT];      // over-limit messages/accepts dropped
+    Counter rateDelayed[RATE_SCOPE_COUNT];   // over-limit messages/accepts held back
+    Counter lockContended[LOCK_CLASS_COUNT];
+    Counter lockWaitNs[LOCK_CLASS_COUNT];
+    LatencyHistogram fanoutLatency;   // ns from recv() to this shard's deliveries being queued
+    LatencyHistogram fanoutCompletion;   // ns from recv() to every shard's deliveries being queued, recorded by the last
+};
+
+// Sum of every shard's counters at one moment
+struct MetricsTotals {
+    uint64_t connectionsAccepted = 0;
+    uint64_t connectionsClosed = 0;
+    uint64_t openConnections = 0;
+    uint64_t messagesReceived = 0;
+    uint64_t messagesQueued = 0;
+    uint64_t bytesReceived = 0;
+    uint64_t bytesSent = 0;
+    uint64_t outputWrites = 0;
+    uint64_t flushesHeld = 0;
+    uint64_t batchingConnections = 0;
+    uint64_t queuedMessages = 0;
+    uint64_t queuedBytes = 0;
+    uint64_t replaysActive = 0;
+    uint64_t replaysDeferred = 0;
+    uint64_t pingsSent = 0;
+    uint64_t handshakeTimeouts = 0;
+    uint64_t idleTimeouts = 0;
+    uint64_t directSent = 0;
+    uint64_t directStored = 0;
+    uint64_t directRefused = 0;
+    uint64_t fanoutDeferred = 0;
+    uint64_t rateShed[RATE_SCOPE_COUNT] = {};
+    uint64_t rateDelayed[RATE_SCOPE_COUNT] = {};
+    uint64_t lockContended[LOCK_CLASS_COUNT] = {};
+    uint64_t lockWaitNs[LOCK_CLASS_COUNT] = {};
+
+    void add(const ShardMetrics& shard) {
+        connectionsAccepted += shard.connectionsAccepted.get();
+        connectionsClosed += shard.connectionsClosed.get();
+        openConnections += shard.openConnections.get();
+        messagesReceived += shard.messagesReceived.get();
+        messagesQueued += shard.messagesQueued.get();
+        bytesReceived += shard.bytesReceived.get();
+        bytesSent += shard.bytesSent.get();
+        outputWrites += shard.outputWrites.get();
+        flushesHeld += shard.flushesHeld.get();
+        batchingConnections += shard.batchingConnections.get();
+        queuedMessages += shard.queuedMessages.get();
+        queuedBytes += shard.queuedBytes.get();
+        replaysActive += shard.replaysActive.get();
+        replaysDeferred += shard.replaysDeferred.get();
+        pingsSent += shard.pingsSent.get();
+        handshakeTimeouts += shard.handshakeTimeouts.get();
+        idleTimeouts += shard.idleTimeouts.get();
+        directSent += shard.directSent.get();
+        directStored += shard.directStored.get();
+        directRefused += shard.directRefused.get();
+        fanoutDeferred += shard.fanoutDeferred.get();
+        for (size_t i = 0; i < RATE_SCOPE_COUNT; ++i) {
+            rateShed[i] += shard.rateShed[i].get();
+            rateDelayed[i] += shard.rateDelayed[i].get();
+        }
+        for (size_t i = 0; i < LOCK_CLASS_COUNT; ++i) {
+            lockContended[i] += shard.lockContended[i].get();
+            lockWaitNs[i] += shard.lockWaitNs[i].get();
+        }
+    }
+};
+
+// Metrics of the shard running on this thread, or null on other threads
+inline ShardMetrics*& currentShardMetrics() {
+    static thread_local ShardMetrics* metrics = nullptr;
+    return metrics;
+}
+
+// std::lock_guard that charges any time spent waiting for the mutex to the
+// current shard. The uncontended path is a single try_lock.
+class TimedLockGuard {
+private:
+    std::mutex& mutex;
+
+public:
+    TimedLockGuard(std::mutex& m, LockClass lock) : mutex(m) {
+        if (mutex.try_lock()) {
+            return;
+        }
+        uint64_t start = ClockService::monotonicNanos();
+        mutex.lock();
+        ShardMetrics* metrics = currentShardMetrics();
+        if (metrics != nullptr) {
+            metrics->lockContended[(size_t)lock].add();
+            metrics->lockWaitNs[(size_t)lock].add(ClockService::monotonicNanos() - start);
+        }
+    }
+
+    ~TimedLockGuard() {
+        mutex.unlock();
+    }
+
+    TimedLockGuard(const TimedLockGuard&) = delete;
+    TimedLockGuard& operator=(const TimedLockGuard&) = delete;
+};
+
+#endif // METRICS_H
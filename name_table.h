@@ -0,0 +1,146 @@
+#ifndef NAME_TABLE_H
+#define NAME_TABLE_H
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "metrics.h"
+
+using NameId = uint32_t;
+
+// Interned usernames and room names. Each distinct name is stored once and
+// everything else refers to it by a small integer id. Entries are
+// reference counted, and an id is recycled once nobody holds it, so
+// clients cycling through made-up names cannot grow the table without
+// bound. Only interning and releasing lock; an entry's text never moves
+// while it is held, so InternedName reads it with no lock at all.
+class NameTable {
+private:
+    struct Entry {
+        std::string text;
+        uint32_t refs;
+    };
+
+    mutable std::mutex mutex;
+    std::deque<Entry> entries;                          // index = id; stable addresses
+    std::unordered_map<std::string_view, NameId> ids;   // views into entries
+    std::vector<NameId> freeIds;
+
+public:
+    NameTable() = default;
+    NameTable(const NameTable&) = delete;
+    NameTable& operator=(const NameTable&) = delete;
+
+    // Returns the id with one reference taken, and the entry's text
+    NameId acquire(std::string_view text, const std::string*& stored) {
+        TimedLockGuard lock(mutex, LockClass::NameTable);
+        auto it = ids.find(text);
+        if (it != ids.end()) {
+            Entry& entry = entries[it->second];
+            ++entry.refs;
+            stored = &entry.text;
+            return it->second;
+        }
+        NameId id;
+        if (!freeIds.empty()) {
+            id = freeIds.back();
+            freeIds.pop_back();
+        }
+        else {
+            id = (NameId)entries.size();
+            entries.emplace_back();
+        }
+        Entry& entry = entries[id];
+        entry.text.assign(text.data(), text.size());
+        entry.refs = 1;
+        ids.emplace(std::string_view(entry.text), id);
+        stored = &entry.text;
+        return id;
+    }
+
+    void release(NameId id) {
+        TimedLockGuard lock(mutex, LockClass::NameTable);
+        Entry& entry = entries[id];
+        if (--entry.refs == 0) {
+            ids.erase(std::string_view(entry.text));
+            std::string().swap(entry.text);
+            freeIds.push_back(id);
+        }
+    }
+
+    // False if nobody currently holds `text`
+    bool find(std::string_view text, NameId& id) const {
+        TimedLockGuard lock(mutex, LockClass::NameTable);
+        auto it = ids.find(text);
+        if (it == ids.end()) {
+            return false;
+        }
+        id = it->second;
+        return true;
+    }
+
+    // Distinct names currently held
+    size_t size() const {
+        TimedLockGuard lock(mutex, LockClass::NameTable);
+        return ids.size();
+    }
+};
+
+// One reference to an interned name, released on destruction
+class InternedName {
+private:
+    NameTable* table;
+    NameId nameId;
+    const std::string* value;
+
+    static const std::string& emptyText() {
+        static const std::string empty;
+        return empty;
+    }
+
+public:
+    InternedName() : table(nullptr), nameId(0), value(&emptyText()) {}
+
+    InternedName(NameTable& names, std::string_view text) : table(&names), nameId(0), value(nullptr) {
+        nameId = names.acquire(text, value);
+    }
+
+    InternedName(InternedName&& other) noexcept : table(other.table), nameId(other.nameId), value(other.value) {
+        other.table = nullptr;
+        other.value = &emptyText();
+    }
+
+    InternedName& operator=(InternedName&& other) noexcept {
+        if (this != &other) {
+            if (table != nullptr) {
+                table->release(nameId);
+            }
+            table = other.table;
+            nameId = other.nameId;
+            value = other.value;
+            other.table = nullptr;
+            other.value = &emptyText();
+        }
+        return *this;
+    }
+
+    InternedName(const InternedName&) = delete;
+    InternedName& operator=(const InternedName&) = delete;
+
+    ~InternedName() {
+        if (table != nullptr) {
+            table->release(nameId);
+        }
+    }
+
+    NameId id() const { return nameId; }
+    const std::string& str() const { return *value; }
+    size_t size() const { return value->size(); }
+    bool empty() const { return table == nullptr; }
+};
+
+#endif // NAME_TABLE_H
@@ -0,0 +1,108 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// What a rate limit is charged against
+enum class RateScope {
+    Connection,
+    Room,
+    Address,   // every connection from one source IP
+    Accept,    // new connections on a shard's listener
+    Count
+};
+
+inline const char* rateScopeName(RateScope scope) {
+    switch (scope) {
+        case RateScope::Connection: return "connection";
+        case RateScope::Room: return "room";
+        case RateScope::Address: return "address";
+        case RateScope::Accept: return "accept";
+        default: return "unknown";
+    }
+}
+
+const size_t RATE_SCOPE_COUNT = (size_t)RateScope::Count;
+
+// `perSecond` events on average, up to `burst` at once; 0 = unlimited
+struct RateLimit {
+    uint64_t intervalNs;    // time one token takes to refill
+    uint64_t capacityNs;    // burst * intervalNs
+
+    RateLimit() : intervalNs(0), capacityNs(0) {}
+
+    RateLimit(double perSecond, double burst) : intervalNs(0), capacityNs(0) {
+        if (perSecond > 0) {
+            intervalNs = (uint64_t)(1e9 / perSecond);
+            if (intervalNs == 0) {
+                intervalNs = 1;
+            }
+            capacityNs = (uint64_t)((burst < 1 ? 1 : burst) * (double)intervalNs);
+        }
+    }
+
+    bool enabled() const { return intervalNs != 0; }
+};
+
+// Token bucket stored as a GCRA "theoretical arrival time": the moment the
+// bucket would be full again. One atomic word holds the whole state, so
+// threads on different shards charge a shared bucket with a single CAS and
+// no lock, and no background refill is needed.
+class TokenBucket {
+private:
+    std::atomic<uint64_t> fullAt;
+
+public:
+    TokenBucket() : fullAt(0) {}
+
+    TokenBucket(const TokenBucket&) = delete;
+    TokenBucket& operator=(const TokenBucket&) = delete;
+
+    // Take one token. Otherwise false, with `waitNs` set to how long until
+    // one is available.
+    bool tryTake(const RateLimit& limit, uint64_t nowNs, uint64_t& waitNs) {
+        if (!limit.enabled()) {
+            return true;
+        }
+        uint64_t current = fullAt.load(std::memory_order_relaxed);
+        for (;;) {
+            uint64_t next = (current > nowNs ? current : nowNs) + limit.intervalNs;
+            if (next > nowNs + limit.capacityNs) {
+                waitNs = next - nowNs - limit.capacityNs;
+                return false;
+            }
+            if (fullAt.compare_exchange_weak(current, next, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+    // Give back a token taken with tryTake(), when what it paid for did not
+    // happen after all
+    void refund(const RateLimit& limit) {
+        if (limit.enabled()) {
+            fullAt.fetch_sub(limit.intervalNs, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Buckets for source addresses, in a fixed table indexed by a hash of the
+// address. Memory stays bounded however many addresses connect; addresses
+// that collide share a bucket, which errs on the side of limiting.
+class AddressRateTable {
+private:
+    static const size_t SLOTS = 4096;   // power of two
+    std::unique_ptr<TokenBucket[]> buckets;
+
+public:
+    AddressRateTable() : buckets(new TokenBucket[SLOTS]) {}
+
+    TokenBucket& bucketFor(uint32_t address) {
+        uint32_t hash = address * 2654435761u;   // Knuth multiplicative hash
+        return buckets[(hash >> 20) & (SLOTS - 1)];
+    }
+};
+
+#endif // RATE_LIMITER_H
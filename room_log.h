@@ -0,0 +1,916 @@
+#ifndef ROOM_LOG_H
+#define ROOM_LOG_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Durable, append-only history for one room.
+//
+// A room's directory holds numbered segments. Each segment is named after
+// the sequence number of its first record:
+//     00000000000000000001.log   records
+//     00000000000000000001.idx   sparse index: (seq, offset) every few KiB
+//
+// Record layout (little-endian):
+//     u32 payload length, u64 seq, u32 CRC-32 of seq + payload, payload
+//
+// Writers only copy the record into a pending buffer. RoomLogStore's
+// flusher thread writes the pending buffers and fsyncs them in batches
+// (group commit). On open, only the last segment is memory-mapped and
+// validated from its last index entry, so startup costs the same no matter
+// how much history exists; a torn final record from a crash is cut off.
+// Replays read records in place from mapped segments, located through the
+// sparse index, so serving old history never copies it. The fsync itself
+// runs outside the log's I/O lock, on descriptors of its own, so a slow
+// disk never stalls the appends and replays that need that lock.
+
+inline uint32_t crc32Update(uint32_t crc, const char* data, size_t length) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) {
+        crc = table[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Read-only mapping of a whole file
+class MappedFile {
+private:
+    const char* bytes;
+    size_t length;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+public:
+    MappedFile() : bytes(nullptr), length(0)
+#ifdef _WIN32
+        , file(INVALID_HANDLE_VALUE), mapping(NULL)
+#endif
+    {}
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size)) {
+            close();
+            return false;
+        }
+        length = (size_t)size.QuadPart;
+        if (length == 0) {
+            return true;
+        }
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) {
+            close();
+            return false;
+        }
+        bytes = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (bytes == nullptr) {
+            close();
+            return false;
+        }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        length = (size_t)info.st_size;
+        if (length > 0) {
+            void* mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapped == MAP_FAILED) {
+                ::close(fd);
+                length = 0;
+                return false;
+            }
+            bytes = (const char*)mapped;
+        }
+        ::close(fd);   // the mapping keeps the file referenced
+#endif
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (bytes != nullptr) {
+            UnmapViewOfFile(bytes);
+        }
+        if (mapping != NULL) {
+            CloseHandle(mapping);
+            mapping = NULL;
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (bytes != nullptr) {
+            munmap(const_cast<char*>(bytes), length);
+        }
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+inline bool syncFile(FILE* file) {
+    if (fflush(file) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// A descriptor of its own for `file`, still valid after the FILE is closed
+inline int duplicateDescriptor(FILE* file) {
+#ifdef _WIN32
+    return _dup(_fileno(file));
+#else
+    return dup(fileno(file));
+#endif
+}
+
+// fsync and close a descriptor from duplicateDescriptor()
+inline bool syncDescriptor(int fd) {
+    if (fd < 0) {
+        return false;
+    }
+#ifdef _WIN32
+    bool synced = _commit(fd) == 0;
+    _close(fd);
+#else
+    bool synced = fsync(fd) == 0;
+    ::close(fd);
+#endif
+    return synced;
+}
+
+struct RoomLogOptions {
+    size_t segmentBytes = 16 * 1024 * 1024;   // roll to a new segment past this size
+    size_t indexInterval = 4096;              // bytes between sparse index entries
+    unsigned fsyncIntervalMs = 10;            // group-commit window; 0 = fsync every append
+    size_t fsyncBytes = 1024 * 1024;          // commit early once this much is pending
+};
+
+class RoomLog {
+public:
+    static const size_t RECORD_HEADER_SIZE = 16;
+    static const size_t INDEX_ENTRY_SIZE = 12;
+
+    struct Record {
+        uint64_t seq;
+        std::string_view payload;
+    };
+
+private:
+    struct IndexEntry {
+        uint64_t seq;
+        uint32_t offset;
+    };
+
+    struct SegmentReader {
+        std::shared_ptr<const MappedFile> mapped;
+        std::vector<IndexEntry> entries;
+    };
+
+    std::filesystem::path directory;
+    RoomLogOptions options;
+
+    std::mutex pendingMutex;
+    std::string pending;                  // encoded records not yet written
+
+    std::atomic<uint64_t> nextSeq;        // one past the last record written; stored under ioMutex
+
+    std::mutex ioMutex;                   // serializes writes; guards everything below
+    std::condition_variable syncDone;
+    std::vector<uint64_t> segmentBases;   // first seq of each segment, ascending
+    FILE* segment;
+    FILE* index;
+    uint64_t segmentSize;
+    uint64_t nextIndexOffset;
+    uint64_t syncedSeq;                   // records before this are on disk
+    bool syncing;                         // a flush is fsyncing outside the lock
+    std::vector<int> unsyncedFiles;       // descriptors of sealed segments still to fsync
+    bool failed;
+    std::map<uint64_t, SegmentReader> readers;   // by segment base, mapped on first read
+
+    static std::string segmentName(uint64_t base, const char* extension) {
+        char name[40];
+        snprintf(name, sizeof(name), "%020llu.%s", (unsigned long long)base, extension);
+        return name;
+    }
+
+    std::string segmentPath(uint64_t base, const char* extension) const {
+        return (directory / segmentName(base, extension)).string();
+    }
+
+    static uint32_t load32(const char* p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint64_t load64(const char* p) {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint32_t recordCrc(const char* seqBytes, const char* payload, size_t length) {
+        return crc32Update(crc32Update(0, seqBytes, 8), payload, length);
+    }
+
+    // Decode the record at `offset`; false if it is incomplete or corrupt
+    static bool decodeAt(const char* data, size_t size, size_t offset, Record& record, size_t& next) {
+        if (offset > size || size - offset < RECORD_HEADER_SIZE) {
+            return false;
+        }
+        const char* header = data + offset;
+        uint32_t length = load32(header);
+        if (size - offset - RECORD_HEADER_SIZE < length) {
+            return false;
+        }
+        const char* payload = header + RECORD_HEADER_SIZE;
+        if (recordCrc(header + 4, payload, length) != load32(header + 12)) {
+            return false;
+        }
+        record.seq = load64(header + 4);
+        record.payload = std::string_view(payload, length);
+        next = offset + RECORD_HEADER_SIZE + length;
+        return true;
+    }
+
+    std::vector<IndexEntry> readIndex(uint64_t base, size_t validBytes) const {
+        std::vector<IndexEntry> entries;
+        FILE* file = fopen(segmentPath(base, "idx").c_str(), "rb");
+        if (file == nullptr) {
+            return entries;
+        }
+        char raw[INDEX_ENTRY_SIZE];
+        while (fread(raw, 1, INDEX_ENTRY_SIZE, file) == INDEX_ENTRY_SIZE) {
+            IndexEntry entry{load64(raw), load32(raw + 8)};
+            if (entry.offset >= validBytes) {
+                break;
+            }
+            entries.push_back(entry);
+        }
+        fclose(file);
+        return entries;
+    }
+
+    bool openSegmentForAppend(uint64_t base) {
+        segment = fopen(segmentPath(base, "log").c_str(), "ab");
+        index = fopen(segmentPath(base, "idx").c_str(), "ab");
+        if (segment == nullptr || index == nullptr) {
+            return false;
+        }
+        setvbuf(segment, nullptr, _IOFBF, 64 * 1024);
+        return true;
+    }
+
+    // Close the active segment on a roll. Its fsync is left to the next
+    // flush(true), on descriptors kept for it.
+    bool sealSegment() {
+        if (fflush(segment) != 0 || fflush(index) != 0) {
+            return false;
+        }
+        unsyncedFiles.push_back(duplicateDescriptor(segment));
+        unsyncedFiles.push_back(duplicateDescriptor(index));
+        fclose(segment);
+        fclose(index);
+        segment = nullptr;
+        index = nullptr;
+        return true;
+    }
+
+    void closeSegment() {
+        if (segment != nullptr) {
+            syncFile(segment);
+            fclose(segment);
+            segment = nullptr;
+        }
+        if (index != nullptr) {
+            syncFile(index);
+            fclose(index);
+            index = nullptr;
+        }
+    }
+
+    // Caller holds ioMutex
+    bool writeRecord(const char* record, size_t length, uint64_t seq) {
+        if (segmentSize > 0 && segmentSize + length > options.segmentBytes) {
+            if (!sealSegment()) {
+                return false;
+            }
+            segmentBases.push_back(seq);
+            segmentSize = 0;
+            nextIndexOffset = options.indexInterval;
+            if (!openSegmentForAppend(seq)) {
+                return false;
+            }
+        }
+        if (segmentSize >= nextIndexOffset) {
+            char entry[INDEX_ENTRY_SIZE];
+            uint32_t offset = (uint32_t)segmentSize;
+            memcpy(entry, &seq, 8);
+            memcpy(entry + 8, &offset, 4);
+            if (fwrite(entry, 1, INDEX_ENTRY_SIZE, index) != INDEX_ENTRY_SIZE) {
+                return false;
+            }
+            nextIndexOffset = (segmentSize / options.indexInterval + 1) * options.indexInterval;
+        }
+        if (fwrite(record, 1, length, segment) != length) {
+            return false;
+        }
+        segmentSize += length;
+        return true;
+    }
+
+    // Mapping of segment `i` for reads. Sealed segments are mapped once;
+    // the active one is remapped whenever it has grown since. Caller holds
+    // ioMutex.
+    const SegmentReader* segmentReader(size_t i) {
+        uint64_t base = segmentBases[i];
+        bool active = i + 1 == segmentBases.size();
+        SegmentReader& reader = readers[base];
+        if (reader.mapped && (!active || reader.mapped->size() >= segmentSize)) {
+            return &reader;
+        }
+        if (active && segment != nullptr && (fflush(segment) != 0 || fflush(index) != 0)) {
+            return nullptr;
+        }
+        auto mapped = std::make_shared<MappedFile>();
+        if (!mapped->open(segmentPath(base, "log"))) {
+            readers.erase(base);
+            return nullptr;
+        }
+        reader.entries = readIndex(base, mapped->size());
+        reader.mapped = std::move(mapped);
+        return &reader;
+    }
+
+    // Write everything pending to the files; caller holds ioMutex
+    bool flushLocked() {
+        std::string batch;
+        {
+            std::lock_guard<std::mutex> pendingLock(pendingMutex);
+            batch.swap(pending);
+        }
+        if (failed || segment == nullptr) {
+            return !failed;
+        }
+        if (batch.empty()) {
+            return true;
+        }
+
+        for (size_t offset = 0; offset < batch.size();) {
+            uint32_t length = load32(batch.data() + offset);
+            uint64_t seq = load64(batch.data() + offset + 4);
+            size_t recordSize = RECORD_HEADER_SIZE + length;
+            if (!writeRecord(batch.data() + offset, recordSize, seq)) {
+                failed = true;
+                return false;
+            }
+            nextSeq.store(seq + 1, std::memory_order_release);
+            offset += recordSize;
+        }
+
+        failed = fflush(segment) != 0 || fflush(index) != 0;
+        return !failed;
+    }
+
+    // Offsets of the last `wanted` records in [0, end) of one mapped
+    // segment, found by scanning index chunks from the end backwards
+    static std::vector<size_t> tailOffsets(const MappedFile& mapped, const std::vector<IndexEntry>& entries,
+                                           size_t end, size_t wanted) {
+        std::vector<size_t> chunkStarts{0};
+        for (const IndexEntry& entry : entries) {
+            if (entry.offset > chunkStarts.back() && entry.offset < end) {
+                chunkStarts.push_back(entry.offset);
+            }
+        }
+        std::vector<size_t> offsets;
+        size_t chunkEnd = end;
+        Record record;
+        size_t next;
+        for (size_t i = chunkStarts.size(); i-- > 0 && offsets.size() < wanted;) {
+            std::vector<size_t> chunk;
+            for (size_t offset = chunkStarts[i];
+                 offset < chunkEnd && decodeAt(mapped.data(), mapped.size(), offset, record, next);
+                 offset = next) {
+                chunk.push_back(offset);
+            }
+            offsets.insert(offsets.begin(), chunk.begin(), chunk.end());
+            chunkEnd = chunkStarts[i];
+        }
+        if (offsets.size() > wanted) {
+            offsets.erase(offsets.begin(), offsets.end() - wanted);
+        }
+        return offsets;
+    }
+
+    // Hand the newest `wanted` records to fn, oldest first. Starts in the
+    // already-mapped last segment and maps earlier segments only while more
+    // records are needed, e.g. right after a segment roll.
+    template <typename Fn>
+    void emitTail(const MappedFile& last, const std::vector<IndexEntry>& lastEntries, size_t lastEnd,
+                  size_t lastIndex, size_t wanted, Fn& fn) {
+        std::vector<std::unique_ptr<MappedFile>> earlier;
+        std::vector<std::pair<const MappedFile*, std::vector<size_t>>> parts;
+        parts.emplace_back(&last, tailOffsets(last, lastEntries, lastEnd, wanted));
+        size_t found = parts.back().second.size();
+
+        for (size_t i = lastIndex; i-- > 0 && found < wanted;) {
+            auto mapped = std::make_unique<MappedFile>();
+            if (!mapped->open(segmentPath(segmentBases[i], "log"))) {
+                break;
+            }
+            std::vector<IndexEntry> entries = readIndex(segmentBases[i], mapped->size());
+            parts.emplace_back(mapped.get(), tailOffsets(*mapped, entries, mapped->size(), wanted - found));
+            found += parts.back().second.size();
+            earlier.push_back(std::move(mapped));
+        }
+
+        Record record;
+        size_t next;
+        for (size_t p = parts.size(); p-- > 0;) {
+            const MappedFile& mapped = *parts[p].first;
+            for (size_t offset : parts[p].second) {
+                decodeAt(mapped.data(), mapped.size(), offset, record, next);
+                fn(record.seq, record.payload);
+            }
+        }
+    }
+
+public:
+    RoomLog(const std::filesystem::path& dir, const RoomLogOptions& opts)
+        : directory(dir), options(opts), segment(nullptr), index(nullptr), segmentSize(0),
+          nextIndexOffset(0), syncedSeq(1), syncing(false), failed(false) {
+        nextSeq.store(1, std::memory_order_relaxed);
+    }
+
+    ~RoomLog() {
+        close();
+    }
+
+    RoomLog(const RoomLog&) = delete;
+    RoomLog& operator=(const RoomLog&) = delete;
+
+    // Recover the last segment and get ready to append. `tail` receives the
+    // newest `tailRecords` records, oldest first, straight from the mapping.
+    template <typename Fn>
+    bool open(size_t tailRecords, Fn&& tail) {
+        std::lock_guard<std::mutex> lock(ioMutex);
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        if (error) {
+            return false;
+        }
+
+        for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+            const std::filesystem::path& path = entry.path();
+            if (path.extension() == ".log") {
+                segmentBases.push_back(std::strtoull(path.stem().string().c_str(), nullptr, 10));
+            }
+        }
+        std::sort(segmentBases.begin(), segmentBases.end());
+        if (segmentBases.empty()) {
+            segmentBases.push_back(1);
+        }
+
+        // Validate the last segment from its last index entry onwards
+        uint64_t base = segmentBases.back();
+        MappedFile mapped;
+        if (!mapped.open(segmentPath(base, "log")) && std::filesystem::exists(segmentPath(base, "log"))) {
+            return false;
+        }
+        std::vector<IndexEntry> entries = readIndex(base, mapped.size());
+        size_t validEnd = entries.empty() ? 0 : entries.back().offset;
+        uint64_t lastSeq = base - 1;
+        Record record;
+        size_t next;
+        while (decodeAt(mapped.data(), mapped.size(), validEnd, record, next)) {
+            lastSeq = record.seq;
+            validEnd = next;
+        }
+
+        emitTail(mapped, entries, validEnd, segmentBases.size() - 1, tailRecords, tail);
+
+        // Cut off a torn write and any index entries pointing past it
+        bool truncate = validEnd < mapped.size();
+        mapped.close();
+        if (truncate) {
+            std::filesystem::resize_file(segmentPath(base, "log"), validEnd, error);
+            std::filesystem::resize_file(segmentPath(base, "idx"), entries.size() * INDEX_ENTRY_SIZE, error);
+        }
+
+        nextSeq.store(lastSeq + 1, std::memory_order_release);
+        syncedSeq = lastSeq + 1;
+        segmentSize = validEnd;
+        nextIndexOffset = (segmentSize / options.indexInterval + 1) * options.indexInterval;
+        return openSegmentForAppend(base);
+    }
+
+    // Write out what is pending and close the files; the fsync runs after
+    // the lock is released. Records stay readable through their mappings.
+    // Nothing may be appended afterwards. Safe to call more than once.
+    void close() {
+        std::vector<int> files;
+        {
+            std::lock_guard<std::mutex> lock(ioMutex);
+            if (segment != nullptr) {
+                flushLocked();
+                if (!sealSegment()) {
+                    failed = true;
+                    closeSegment();
+                }
+            }
+            files.swap(unsyncedFiles);
+            syncedSeq = nextSeq.load(std::memory_order_relaxed);
+        }
+        bool synced = true;
+        for (int fd : files) {
+            synced = syncDescriptor(fd) && synced;
+        }
+        if (!synced) {
+            std::lock_guard<std::mutex> lock(ioMutex);
+            failed = true;
+        }
+    }
+
+    const std::filesystem::path& path() const { return directory; }
+
+    // Sequence number the next appended record must carry
+    uint64_t nextSequence() const {
+        return nextSeq.load(std::memory_order_acquire);
+    }
+
+    // Queue a record; returns the number of bytes now pending
+    size_t append(uint64_t seq, std::string_view payload) {
+        char header[RECORD_HEADER_SIZE];
+        uint32_t length = (uint32_t)payload.size();
+        memcpy(header, &length, 4);
+        memcpy(header + 4, &seq, 8);
+        uint32_t crc = recordCrc(header + 4, payload.data(), payload.size());
+        memcpy(header + 12, &crc, 4);
+
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        pending.append(header, RECORD_HEADER_SIZE);
+        pending.append(payload.data(), payload.size());
+        return pending.size();
+    }
+
+    // Write everything pending, fsync if `sync`. Returns false once a write
+    // has failed; the log then stops accepting data. With `sync` it returns
+    // once everything written so far is on disk. One flush syncs at a time;
+    // the others wait, and need no fsync of their own if it covered them.
+    bool flush(bool sync) {
+        std::unique_lock<std::mutex> lock(ioMutex);
+        if (!flushLocked() || !sync) {
+            return !failed;
+        }
+        uint64_t target = nextSeq.load(std::memory_order_relaxed);
+        syncDone.wait(lock, [this, target] { return failed || syncedSeq >= target || !syncing; });
+        if (failed || syncedSeq >= target || segment == nullptr) {
+            return !failed;
+        }
+
+        // Cover whatever else was written while this flush waited
+        target = nextSeq.load(std::memory_order_relaxed);
+        std::vector<int> files;
+        files.swap(unsyncedFiles);
+        files.push_back(duplicateDescriptor(segment));
+        files.push_back(duplicateDescriptor(index));
+        syncing = true;
+        lock.unlock();
+
+        bool synced = true;
+        for (int fd : files) {
+            synced = syncDescriptor(fd) && synced;
+        }
+
+        lock.lock();
+        syncing = false;
+        if (synced) {
+            syncedSeq = target;
+        }
+        else {
+            failed = true;
+        }
+        syncDone.notify_all();
+        return !failed;
+    }
+
+    // fn(seq, payload, mapped) for up to `limit` records with
+    // from <= seq <= to, oldest first; returns how many were handed out.
+    // Payloads point into `mapped`, which stays valid for as long as the
+    // caller keeps a reference to it. Records still pending are written
+    // out first if the range reaches them.
+    template <typename Fn>
+    size_t read(uint64_t from, uint64_t to, size_t limit, Fn&& fn) {
+        std::lock_guard<std::mutex> lock(ioMutex);
+        if (to >= nextSeq.load(std::memory_order_relaxed)) {
+            flushLocked();
+        }
+
+        size_t i = std::upper_bound(segmentBases.begin(), segmentBases.end(), from) - segmentBases.begin();
+        size_t count = 0;
+        for (i = i > 0 ? i - 1 : 0; i < segmentBases.size() && count < limit; ++i) {
+            const SegmentReader* reader = segmentReader(i);
+            if (reader == nullptr) {
+                break;
+            }
+            const MappedFile& mapped = *reader->mapped;
+            size_t offset = 0;
+            for (const IndexEntry& entry : reader->entries) {
+                if (entry.seq > from) {
+                    break;
+                }
+                offset = entry.offset;
+            }
+            Record record;
+            size_t next;
+            for (; count < limit && decodeAt(mapped.data(), mapped.size(), offset, record, next); offset = next) {
+                if (record.seq > to) {
+                    return count;
+                }
+                if (record.seq >= from) {
+                    fn(record.seq, record.payload, reader->mapped);
+                    ++count;
+                }
+            }
+        }
+        return count;
+    }
+};
+
+// Every room's log, plus the flusher thread that group-commits them
+class RoomLogStore {
+private:
+    std::filesystem::path root;
+    RoomLogOptions options;
+    std::mutex logsMutex;
+    std::vector<std::shared_ptr<RoomLog>> logs;
+    std::vector<std::shared_ptr<RoomLog>> retiring;   // evicted, waiting for the flusher to close them
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    bool stopping;
+    bool urgent;
+    std::atomic<uint64_t> commits;
+    std::thread flusher;
+
+    // Room names become directory names: keep [A-Za-z0-9_-], %XX the rest
+    static std::string escapeName(const std::string& name) {
+        static const char* hex = "0123456789ABCDEF";
+        std::string escaped;
+        for (unsigned char c : name) {
+            if (std::isalnum(c) || c == '_' || c == '-') {
+                escaped += (char)c;
+            }
+            else {
+                escaped += '%';
+                escaped += hex[c >> 4];
+                escaped += hex[c & 15];
+            }
+        }
+        return escaped;
+    }
+
+    static std::string unescapeName(const std::string& escaped) {
+        std::string name;
+        for (size_t i = 0; i < escaped.size(); ++i) {
+            if (escaped[i] == '%' && i + 2 < escaped.size()) {
+                name += (char)std::strtoul(escaped.substr(i + 1, 2).c_str(), nullptr, 16);
+                i += 2;
+            }
+            else {
+                name += escaped[i];
+            }
+        }
+        return name;
+    }
+
+    void commitAll() {
+        std::vector<std::shared_ptr<RoomLog>> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(logsMutex);
+            snapshot = logs;
+        }
+        for (const auto& log : snapshot) {
+            log->flush(true);
+        }
+        commits.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Close the logs of evicted rooms. Each stays listed until it is
+    // closed, so that opening the room again meanwhile can wait for it.
+    void closeRetired() {
+        std::vector<std::shared_ptr<RoomLog>> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(logsMutex);
+            snapshot = retiring;
+        }
+        for (const auto& log : snapshot) {
+            log->close();
+            std::lock_guard<std::mutex> lock(logsMutex);
+            auto it = std::find(retiring.begin(), retiring.end(), log);
+            if (it != retiring.end()) {
+                retiring.erase(it);
+            }
+        }
+    }
+
+    // Group-commits every fsyncIntervalMs, or sooner when woken. With
+    // fsyncIntervalMs == 0 appends commit themselves and the thread only
+    // closes retired logs.
+    void runFlusher() {
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        auto woken = [this] { return stopping || urgent; };
+        while (!stopping) {
+            if (options.fsyncIntervalMs > 0) {
+                wake.wait_for(lock, std::chrono::milliseconds(options.fsyncIntervalMs), woken);
+            }
+            else {
+                wake.wait(lock, woken);
+            }
+            urgent = false;
+            lock.unlock();
+            closeRetired();
+            if (options.fsyncIntervalMs > 0) {
+                commitAll();
+            }
+            lock.lock();
+        }
+    }
+
+    void wakeFlusher() {
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            urgent = true;
+        }
+        wake.notify_one();
+    }
+
+public:
+    RoomLogStore(const std::string& dataDir, const RoomLogOptions& opts)
+        : root(dataDir), options(opts), stopping(false), urgent(false), commits(0) {}
+
+    ~RoomLogStore() {
+        stop();
+    }
+
+    bool start() {
+        std::error_code error;
+        std::filesystem::create_directories(root, error);
+        if (error) {
+            return false;
+        }
+        flusher = std::thread(&RoomLogStore::runFlusher, this);
+        return true;
+    }
+
+    // Write and fsync everything still pending, then stop the flusher
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+        commitAll();
+        closeRetired();
+    }
+
+    // Names of the rooms that have a log on disk
+    std::vector<std::string> discoverRooms() const {
+        std::vector<std::string> names;
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(root, error)) {
+            if (entry.is_directory()) {
+                names.push_back(unescapeName(entry.path().filename().string()));
+            }
+        }
+        return names;
+    }
+
+    // See RoomLog::open() for `tail`; null if the log cannot be opened
+    template <typename Fn>
+    std::shared_ptr<RoomLog> openRoom(const std::string& name, size_t tailRecords, Fn&& tail) {
+        auto log = std::make_shared<RoomLog>(root / escapeName(name), options);
+
+        // An evicted log of the same room the flusher has not closed yet
+        // may still hold records in memory. Write them out first; syncing
+        // and closing stay with the flusher.
+        std::vector<std::shared_ptr<RoomLog>> earlier;
+        {
+            std::lock_guard<std::mutex> lock(logsMutex);
+            for (const auto& retired : retiring) {
+                if (retired->path() == log->path()) {
+                    earlier.push_back(retired);
+                }
+            }
+        }
+        for (const auto& retired : earlier) {
+            retired->flush(false);
+        }
+
+        if (!log->open(tailRecords, tail)) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(logsMutex);
+        logs.push_back(log);
+        return log;
+    }
+
+    // Stop committing a room's log, e.g. when the room is evicted. No I/O
+    // happens here: the flusher thread writes out what is pending, syncs
+    // and closes the files, and holds the log until it has.
+    void closeRoom(const std::shared_ptr<RoomLog>& log) {
+        {
+            std::lock_guard<std::mutex> lock(logsMutex);
+            auto it = std::find(logs.begin(), logs.end(), log);
+            if (it != logs.end()) {
+                logs.erase(it);
+            }
+            retiring.push_back(log);
+        }
+        wakeFlusher();
+    }
+
+    // Call after RoomLog::append() with its result
+    void appended(RoomLog& log, size_t pendingBytes) {
+        if (options.fsyncIntervalMs == 0) {
+            log.flush(true);
+            commits.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if (pendingBytes >= options.fsyncBytes) {
+            wakeFlusher();
+        }
+    }
+
+    uint64_t commitCount() const { return commits.load(std::memory_order_relaxed); }
+};
+
+#endif // ROOM_LOG_H
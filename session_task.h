@@ -0,0 +1,85 @@
+#ifndef SESSION_TASK_H
+#define SESSION_TASK_H
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include "slab_allocator.h"
+
+// Coroutine that runs one connection's protocol. It starts as soon as it
+// is created and runs until its first wait on the reactor, which resumes
+// it once what it waits for has happened. The task owns the coroutine
+// frame. Destroying the task, normally along with its connection,
+// destroys the frame wherever it is suspended. Frames come from the
+// calling thread's SlabPool.
+class SessionTask {
+public:
+    struct promise_type {
+        static void* operator new(size_t size) {
+            size_t largest = largestFrame().load(std::memory_order_relaxed);
+            while (size > largest && !largestFrame().compare_exchange_weak(largest, size, std::memory_order_relaxed)) {}
+            return SlabPool::allocate(size);
+        }
+
+        static void operator delete(void* memory, size_t size) {
+            SlabPool::free(memory, size);
+        }
+
+        SessionTask get_return_object() {
+            return SessionTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+
+        // Stay suspended once finished: the task decides when the frame goes
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit SessionTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+    static std::atomic<size_t>& largestFrame() {
+        static std::atomic<size_t> bytes(0);
+        return bytes;
+    }
+
+public:
+    SessionTask() : handle(nullptr) {}
+
+    SessionTask(SessionTask&& other) noexcept : handle(other.handle) {
+        other.handle = nullptr;
+    }
+
+    SessionTask& operator=(SessionTask&& other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = other.handle;
+            other.handle = nullptr;
+        }
+        return *this;
+    }
+
+    SessionTask(const SessionTask&) = delete;
+    SessionTask& operator=(const SessionTask&) = delete;
+
+    ~SessionTask() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool done() const { return !handle || handle.done(); }
+
+    // Size of the largest session frame allocated so far
+    static size_t frameBytes() { return largestFrame().load(std::memory_order_relaxed); }
+};
+
+#endif // SESSION_TASK_H
@@ -0,0 +1,133 @@
+#ifndef SHARED_BUFFER_H
+#define SHARED_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string_view>
+#include "slab_allocator.h"
+
+// Immutable, reference-counted bytes. A broadcast is encoded once into a
+// block and every recipient's queue holds a SharedBuffer viewing it, so
+// fan-out costs a reference-count increment rather than a copy. A
+// SharedBuffer may view only part of its block (see slice()), or bytes
+// owned by something else entirely, such as a memory-mapped file (see
+// external()).
+class SharedBuffer {
+private:
+    struct Block {
+        std::atomic<uint32_t> refs;
+        size_t allocated;                    // bytes taken from the SlabPool
+        std::shared_ptr<const void> owner;   // keeps external bytes alive
+
+        char* bytes() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+    Block* block;
+    const char* ptr;
+    size_t len;
+
+    static void retain(Block* b) {
+        if (b != nullptr) {
+            b->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    static void release(Block* b) {
+        if (b != nullptr && b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            size_t allocated = b->allocated;
+            b->~Block();
+            SlabPool::free(b, allocated);
+        }
+    }
+
+public:
+    SharedBuffer() : block(nullptr), ptr(nullptr), len(0) {}
+
+    // Uninitialized storage; fill it through writableData() before sharing
+    static SharedBuffer allocate(size_t size) {
+        void* memory = SlabPool::allocate(sizeof(Block) + size);
+        Block* b = new (memory) Block();
+        b->refs.store(1, std::memory_order_relaxed);
+        b->allocated = sizeof(Block) + size;
+        SharedBuffer buffer;
+        buffer.block = b;
+        buffer.ptr = b->bytes();
+        buffer.len = size;
+        return buffer;
+    }
+
+    // View `length` bytes at `data` without copying; `owner` is held until
+    // the last view is released
+    static SharedBuffer external(std::shared_ptr<const void> owner, const char* data, size_t length) {
+        SharedBuffer buffer = allocate(0);
+        buffer.block->owner = std::move(owner);
+        buffer.ptr = data;
+        buffer.len = length;
+        return buffer;
+    }
+
+    static SharedBuffer copyOf(std::string_view bytes) {
+        SharedBuffer buffer = allocate(bytes.size());
+        memcpy(buffer.writableData(), bytes.data(), bytes.size());
+        return buffer;
+    }
+
+    SharedBuffer(const SharedBuffer& other) : block(other.block), ptr(other.ptr), len(other.len) {
+        retain(block);
+    }
+
+    SharedBuffer(SharedBuffer&& other) noexcept : block(other.block), ptr(other.ptr), len(other.len) {
+        other.block = nullptr;
+        other.ptr = nullptr;
+        other.len = 0;
+    }
+
+    SharedBuffer& operator=(const SharedBuffer& other) {
+        if (this != &other) {
+            retain(other.block);
+            release(block);
+            block = other.block;
+            ptr = other.ptr;
+            len = other.len;
+        }
+        return *this;
+    }
+
+    SharedBuffer& operator=(SharedBuffer&& other) noexcept {
+        if (this != &other) {
+            release(block);
+            block = other.block;
+            ptr = other.ptr;
+            len = other.len;
+            other.block = nullptr;
+            other.ptr = nullptr;
+            other.len = 0;
+        }
+        return *this;
+    }
+
+    ~SharedBuffer() {
+        release(block);
+    }
+
+    const char* data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    std::string_view view() const { return std::string_view(ptr, len); }
+
+    // Only valid while this is the sole reference
+    char* writableData() { return const_cast<char*>(ptr); }
+
+    // Another view of the same block; shares ownership
+    SharedBuffer slice(size_t offset, size_t length) const {
+        SharedBuffer part(*this);
+        part.ptr += offset;
+        part.len = length;
+        return part;
+    }
+};
+
+#endif // SHARED_BUFFER_H
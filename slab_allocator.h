@@ -0,0 +1,246 @@
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+struct AllocatorStats {
+    uint64_t slabBytes = 0;        // reserved from the global heap
+    uint64_t blocksInUse = 0;
+    uint64_t allocations = 0;      // blocks handed out, ever
+    uint64_t remoteFrees = 0;      // blocks returned by a thread other than the owner
+    uint64_t heapFallbacks = 0;    // requests too large for a slab block
+};
+
+// Slab allocator for the small objects a reactor churns through: message
+// buffers, inbox nodes, outbound queue chunks and connections. Each
+// reactor thread owns a pool. Memory comes from the heap in 64 KiB slabs,
+// each cut into equal blocks of one size class (64 B to 8 KiB), and freed
+// blocks go on their class's free list. Once the pools are warm, steady
+// traffic never calls the global allocator.
+//
+// A block freed on another thread, e.g. a broadcast released by the last
+// shard to send it, is pushed onto the owner's lock-free remote list. The
+// owner takes that list back when its own list runs dry. Threads without a
+// pool share one under a mutex. Blocks can outlive the thread that
+// allocated them, so pools are never destroyed. Callers pass the size back
+// on free, like sized delete.
+class SlabPool {
+public:
+    static const size_t SLAB_BYTES = 64 * 1024;   // also the slab alignment
+    static const size_t CLASS_COUNT = 8;
+    static const size_t MIN_BLOCK = 64;
+    static const size_t MAX_BLOCK = MIN_BLOCK << (CLASS_COUNT - 1);
+
+private:
+    struct FreeNode {
+        FreeNode* next;
+    };
+
+    // At the start of every slab, so a block finds its pool by masking
+    struct alignas(64) SlabHeader {
+        SlabPool* pool;
+        size_t sizeClass;
+    };
+
+    FreeNode* localFree[CLASS_COUNT];
+    std::atomic<FreeNode*> remoteFree[CLASS_COUNT];
+    bool shared;                 // used by threads without a pool of their own
+    std::mutex sharedMutex;
+    std::atomic<uint64_t> slabBytes;
+    std::atomic<uint64_t> allocations;
+    std::atomic<uint64_t> localFrees;
+    std::atomic<uint64_t> remoteFrees;
+    std::atomic<uint64_t> heapFallbacks;
+
+    static inline thread_local SlabPool* threadPool = nullptr;
+    static inline std::mutex registryMutex;
+    static inline std::vector<SlabPool*> registry;
+
+    explicit SlabPool(bool isShared) : shared(isShared), slabBytes(0), allocations(0), localFrees(0),
+                                       remoteFrees(0), heapFallbacks(0) {
+        for (size_t i = 0; i < CLASS_COUNT; ++i) {
+            localFree[i] = nullptr;
+            remoteFree[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    static SlabPool& sharedPool() {
+        static SlabPool* pool = create(true);
+        return *pool;
+    }
+
+    static SlabPool& current() {
+        return threadPool != nullptr ? *threadPool : sharedPool();
+    }
+
+    static size_t sizeClassFor(size_t size) {
+        size_t sizeClass = 0;
+        size_t blockSize = MIN_BLOCK;
+        while (blockSize < size) {
+            blockSize <<= 1;
+            ++sizeClass;
+        }
+        return sizeClass;
+    }
+
+    static SlabHeader& slabOf(void* block) {
+        return *reinterpret_cast<SlabHeader*>((uintptr_t)block & ~(uintptr_t)(SLAB_BYTES - 1));
+    }
+
+    void* take(size_t sizeClass) {
+        FreeNode* node = localFree[sizeClass];
+        if (node == nullptr) {
+            node = remoteFree[sizeClass].exchange(nullptr, std::memory_order_acquire);
+        }
+        if (node == nullptr) {
+            node = carveSlab(sizeClass);
+        }
+        localFree[sizeClass] = node->next;
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return node;
+    }
+
+    void give(void* block, size_t sizeClass) {
+        FreeNode* node = static_cast<FreeNode*>(block);
+        node->next = localFree[sizeClass];
+        localFree[sizeClass] = node;
+        localFrees.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void giveRemote(void* block, size_t sizeClass) {
+        FreeNode* node = static_cast<FreeNode*>(block);
+        FreeNode* head = remoteFree[sizeClass].load(std::memory_order_relaxed);
+        do {
+            node->next = head;
+        } while (!remoteFree[sizeClass].compare_exchange_weak(head, node, std::memory_order_release,
+                                                               std::memory_order_relaxed));
+        remoteFrees.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // A fresh slab, cut into a list of blocks
+    FreeNode* carveSlab(size_t sizeClass) {
+        char* slab = static_cast<char*>(::operator new(SLAB_BYTES, std::align_val_t(SLAB_BYTES)));
+        slabBytes.fetch_add(SLAB_BYTES, std::memory_order_relaxed);
+        new (slab) SlabHeader{this, sizeClass};
+        size_t blockSize = MIN_BLOCK << sizeClass;
+        size_t first = (sizeof(SlabHeader) + blockSize - 1) / blockSize * blockSize;
+        FreeNode* head = nullptr;
+        for (size_t offset = SLAB_BYTES - blockSize; offset >= first; offset -= blockSize) {
+            FreeNode* node = reinterpret_cast<FreeNode*>(slab + offset);
+            node->next = head;
+            head = node;
+            if (offset == first) {
+                break;
+            }
+        }
+        return head;
+    }
+
+public:
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    static SlabPool* create(bool isShared = false) {
+        SlabPool* pool = new SlabPool(isShared);
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry.push_back(pool);
+        return pool;
+    }
+
+    // Allocate from `pool` on this thread from now on
+    static void install(SlabPool* pool) {
+        threadPool = pool;
+    }
+
+    static void* allocate(size_t size) {
+        if (size > MAX_BLOCK) {
+            current().heapFallbacks.fetch_add(1, std::memory_order_relaxed);
+            return ::operator new(size);
+        }
+        SlabPool& pool = current();
+        size_t sizeClass = sizeClassFor(size);
+        if (pool.shared) {
+            std::lock_guard<std::mutex> lock(pool.sharedMutex);
+            return pool.take(sizeClass);
+        }
+        return pool.take(sizeClass);
+    }
+
+    // Memory a request for `size` bytes actually takes
+    static size_t blockSize(size_t size) {
+        return size > MAX_BLOCK ? size : MIN_BLOCK << sizeClassFor(size);
+    }
+
+    // `size` as passed to allocate()
+    static void free(void* block, size_t size) {
+        if (block == nullptr) {
+            return;
+        }
+        if (size > MAX_BLOCK) {
+            ::operator delete(block);
+            return;
+        }
+        SlabHeader& slab = slabOf(block);
+        SlabPool& owner = *slab.pool;
+        if (&owner == threadPool) {
+            owner.give(block, slab.sizeClass);
+        }
+        else if (owner.shared && threadPool == nullptr) {
+            std::lock_guard<std::mutex> lock(owner.sharedMutex);
+            owner.give(block, slab.sizeClass);
+        }
+        else {
+            owner.giveRemote(block, slab.sizeClass);
+        }
+    }
+
+    // Summed over every pool; counters are read without stopping anyone
+    static AllocatorStats totals() {
+        AllocatorStats stats;
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (SlabPool* pool : registry) {
+            uint64_t allocated = pool->allocations.load(std::memory_order_relaxed);
+            uint64_t freed = pool->localFrees.load(std::memory_order_relaxed) +
+                             pool->remoteFrees.load(std::memory_order_relaxed);
+            stats.slabBytes += pool->slabBytes.load(std::memory_order_relaxed);
+            stats.blocksInUse += allocated > freed ? allocated - freed : 0;
+            stats.allocations += allocated;
+            stats.remoteFrees += pool->remoteFrees.load(std::memory_order_relaxed);
+            stats.heapFallbacks += pool->heapFallbacks.load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+};
+
+// Standard allocator over the calling thread's SlabPool, for containers
+// whose nodes or chunks are allocated and freed all the time
+template <typename T>
+struct SlabAllocator {
+    using value_type = T;
+
+    SlabAllocator() = default;
+
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(SlabPool::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        SlabPool::free(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const SlabAllocator<U>&) const { return true; }
+
+    template <typename U>
+    bool operator!=(const SlabAllocator<U>&) const { return false; }
+};
+
+#endif // SLAB_ALLOCATOR_H
@@ -0,0 +1,110 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstdint>
+#include <vector>
+
+// Hashed timing wheel. Time is cut into ticks and a timer is hashed into
+// the slot for its deadline tick; slots are intrusive doubly-linked lists,
+// so arming and cancelling are O(1) and need no allocation. Deadlines
+// further out than one revolution share slots with nearer ones and are
+// skipped until their tick comes round. advance() only visits the slots
+// for ticks that have elapsed, so tracking 100k idle connections costs
+// nothing between their deadlines.
+//
+// Not thread-safe: each shard owns a wheel and only its thread touches it.
+class TimerWheel {
+public:
+    // Embedded in whatever owns the timeout, e.g. a connection
+    struct Timer {
+        Timer* prev;
+        Timer* next;
+        uint64_t deadlineTick;
+        void* owner;
+
+        explicit Timer(void* o = nullptr) : prev(nullptr), next(nullptr), deadlineTick(0), owner(o) {}
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        bool armed() const { return next != nullptr; }
+    };
+
+private:
+    std::vector<Timer> slots;        // list heads; a slot's list is circular
+    std::vector<Timer*> expired;     // reused by advance()
+    uint64_t tickNs;
+    uint64_t currentTick;            // every tick up to this one has fired
+    size_t armedCount;
+
+    static void unlink(Timer& timer) {
+        timer.prev->next = timer.next;
+        timer.next->prev = timer.prev;
+        timer.prev = nullptr;
+        timer.next = nullptr;
+    }
+
+public:
+    // `slotCount` must be a power of two
+    TimerWheel(size_t slotCount, uint64_t tickNanos, uint64_t nowNs)
+        : slots(slotCount), tickNs(tickNanos), currentTick(nowNs / tickNanos), armedCount(0) {
+        for (Timer& head : slots) {
+            head.prev = &head;
+            head.next = &head;
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    uint64_t tickNanos() const { return tickNs; }
+    size_t size() const { return armedCount; }
+
+    // (Re)arm to fire `delayNs` from `nowNs`, rounded up to a whole tick
+    void arm(Timer& timer, uint64_t nowNs, uint64_t delayNs) {
+        cancel(timer);
+        uint64_t deadline = (nowNs + delayNs + tickNs - 1) / tickNs;
+        timer.deadlineTick = deadline > currentTick ? deadline : currentTick + 1;
+        Timer& head = slots[timer.deadlineTick & (slots.size() - 1)];
+        timer.prev = head.prev;
+        timer.next = &head;
+        head.prev->next = &timer;
+        head.prev = &timer;
+        ++armedCount;
+    }
+
+    void cancel(Timer& timer) {
+        if (timer.armed()) {
+            unlink(timer);
+            --armedCount;
+        }
+    }
+
+    // Fire every timer whose deadline has passed, in tick order. A timer is
+    // disarmed before fire(timer) runs, so the callback may re-arm it; it
+    // must not destroy other timers.
+    template <typename Fn>
+    void advance(uint64_t nowNs, Fn&& fire) {
+        uint64_t target = nowNs / tickNs;
+        while (currentTick < target) {
+            ++currentTick;
+            if (armedCount == 0) {
+                currentTick = target;
+                break;
+            }
+            Timer& head = slots[currentTick & (slots.size() - 1)];
+            for (Timer* timer = head.next; timer != &head; timer = timer->next) {
+                if (timer->deadlineTick <= currentTick) {
+                    expired.push_back(timer);
+                }
+            }
+            for (Timer* timer : expired) {
+                cancel(*timer);
+                fire(*timer);
+            }
+            expired.clear();
+        }
+    }
+};
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,169 @@
+#ifndef USER_DIRECTORY_H
+#define USER_DIRECTORY_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "windows_sockets.h"
+#include "metrics.h"
+#include "name_table.h"
+#include "shared_buffer.h"
+
+// Where direct messages for a username go. The index is split into
+// stripes by a hash of the name, each with its own lock, so a /msg takes
+// one short stripe lock and no registry or room lock. It maps each name to
+// every connection using it (usernames are not unique), as shard and
+// socket.
+//
+// Messages for a user with no connection wait in a per-user buffer until
+// the user next connects. Each user keeps at most `perUserLimit` messages
+// (the oldest go first), and all buffers together are charged against one
+// byte budget. Once the budget is spent, new offline messages are refused
+// rather than stored.
+class UserDirectory {
+public:
+    struct Endpoint {
+        size_t shard;
+        SOCKET socket;
+        NameId user;     // the connection's interned username, to tell a reused socket apart
+    };
+
+    enum class Route {
+        Online,     // endpoints filled in
+        Stored,     // buffered until the user connects
+        Refused     // offline and the buffer budget is spent
+    };
+
+private:
+    static const size_t STRIPES = 64;   // power of two
+    static const size_t ENTRY_OVERHEAD = 64;   // charged per buffered user besides the name
+
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view name) const { return std::hash<std::string_view>()(name); }
+    };
+
+    struct Entry {
+        std::vector<Endpoint> online;
+        std::deque<SharedBuffer> offline;   // encoded messages, oldest first
+    };
+
+    struct alignas(64) Stripe {
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry, NameHash, std::equal_to<>> users;
+    };
+
+    std::unique_ptr<Stripe[]> stripes;
+    size_t perUserLimit;
+    size_t budgetBytes;
+    std::atomic<size_t> offlineBytes;
+    std::atomic<size_t> offlineMessages;
+
+    Stripe& stripeFor(std::string_view name) {
+        size_t hash = NameHash()(name);
+        return stripes[(hash ^ (hash >> 17)) & (STRIPES - 1)];
+    }
+
+    static size_t entryCost(std::string_view name) {
+        return name.size() + ENTRY_OVERHEAD;
+    }
+
+    // Give back what a user's buffer was charged; caller holds the stripe lock
+    void release(const std::string& name, Entry& entry) {
+        size_t bytes = 0;
+        for (const SharedBuffer& message : entry.offline) {
+            bytes += message.size();
+        }
+        if (!entry.offline.empty()) {
+            bytes += entryCost(name);
+        }
+        offlineBytes.fetch_sub(bytes, std::memory_order_relaxed);
+        offlineMessages.fetch_sub(entry.offline.size(), std::memory_order_relaxed);
+        entry.offline.clear();
+    }
+
+public:
+    UserDirectory(size_t perUser, size_t budget)
+        : stripes(new Stripe[STRIPES]), perUserLimit(perUser), budgetBytes(budget), offlineBytes(0), offlineMessages(0) {}
+
+    UserDirectory(const UserDirectory&) = delete;
+    UserDirectory& operator=(const UserDirectory&) = delete;
+
+    // Register a connection, and take the messages that waited for the user
+    void connect(std::string_view name, Endpoint at, std::vector<SharedBuffer>& waiting) {
+        Stripe& stripe = stripeFor(name);
+        TimedLockGuard lock(stripe.mutex, LockClass::UserDirectory);
+        auto it = stripe.users.find(name);
+        if (it == stripe.users.end()) {
+            it = stripe.users.emplace(std::string(name), Entry()).first;
+        }
+        Entry& entry = it->second;
+        entry.online.push_back(at);
+        waiting.assign(entry.offline.begin(), entry.offline.end());
+        release(it->first, entry);
+    }
+
+    void disconnect(std::string_view name, Endpoint at) {
+        Stripe& stripe = stripeFor(name);
+        TimedLockGuard lock(stripe.mutex, LockClass::UserDirectory);
+        auto it = stripe.users.find(name);
+        if (it == stripe.users.end()) {
+            return;
+        }
+        std::vector<Endpoint>& online = it->second.online;
+        for (size_t i = 0; i < online.size(); ++i) {
+            if (online[i].shard == at.shard && online[i].socket == at.socket) {
+                online[i] = online.back();
+                online.pop_back();
+                break;
+            }
+        }
+        if (online.empty() && it->second.offline.empty()) {
+            stripe.users.erase(it);
+        }
+    }
+
+    // Find the user's connections, or buffer `message` if there are none.
+    // Deciding and buffering happen under one lock, so a message is never
+    // buffered for a user who has just connected.
+    Route route(std::string_view name, const SharedBuffer& message, std::vector<Endpoint>& endpoints) {
+        Stripe& stripe = stripeFor(name);
+        TimedLockGuard lock(stripe.mutex, LockClass::UserDirectory);
+        auto it = stripe.users.find(name);
+        if (it != stripe.users.end() && !it->second.online.empty()) {
+            endpoints.assign(it->second.online.begin(), it->second.online.end());
+            return Route::Online;
+        }
+
+        size_t cost = message.size() + (it == stripe.users.end() ? entryCost(name) : 0);
+        size_t used = offlineBytes.fetch_add(cost, std::memory_order_relaxed);
+        if (used + cost > budgetBytes) {
+            offlineBytes.fetch_sub(cost, std::memory_order_relaxed);
+            return Route::Refused;
+        }
+        if (it == stripe.users.end()) {
+            it = stripe.users.emplace(std::string(name), Entry()).first;
+        }
+        std::deque<SharedBuffer>& offline = it->second.offline;
+        offline.push_back(message);
+        offlineMessages.fetch_add(1, std::memory_order_relaxed);
+        while (offline.size() > perUserLimit) {
+            offlineBytes.fetch_sub(offline.front().size(), std::memory_order_relaxed);
+            offlineMessages.fetch_sub(1, std::memory_order_relaxed);
+            offline.pop_front();
+        }
+        return Route::Stored;
+    }
+
+    size_t bufferedMessages() const { return offlineMessages.load(std::memory_order_relaxed); }
+    size_t bufferedBytes() const { return offlineBytes.load(std::memory_order_relaxed); }
+};
+
+#endif // USER_DIRECTORY_H
@@ -1,9 +1,13 @@
 #ifndef WINDOWS_SOCKETS_H
 #define WINDOWS_SOCKETS_H
 
+#include <ctime>
+
 #ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mstcpip.h>
 #include <windows.h>
-#include <winsock.h>
 
 // Only define if not already defined
 #ifndef SOCKET
@@ -39,6 +43,185 @@ typedef UINT_PTR SOCKET;
 #define SOMAXCONN       0x7fffffff
 #endif
 
+// Winsock never raises SIGPIPE
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL    0
+#endif
+
+inline bool setSocketNonBlocking(SOCKET s, bool enabled = true) {
+    u_long mode = enabled ? 1 : 0;
+    return ioctlsocket(s, FIONBIO, &mode) == 0;
+}
+
+inline bool setSocketReceiveTimeout(SOCKET s, unsigned milliseconds) {
+    DWORD timeout = milliseconds;
+    return setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == 0;
+}
+
+// Let the kernel probe a connection that has been silent for `idleSeconds`
+inline bool enableTcpKeepalive(SOCKET s, unsigned idleSeconds) {
+    tcp_keepalive settings;
+    settings.onoff = 1;
+    settings.keepalivetime = idleSeconds * 1000;
+    settings.keepaliveinterval = 5000;
+    DWORD returned = 0;
+    return WSAIoctl(s, SIO_KEEPALIVE_VALS, &settings, sizeof(settings), nullptr, 0, &returned, nullptr, nullptr) == 0;
+}
+
+inline void raiseFileDescriptorLimit() {}
+
+#else // POSIX
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+typedef int SOCKET;
+
+#define INVALID_SOCKET  (-1)
+#define SOCKET_ERROR    (-1)
+#define WSAEWOULDBLOCK  EWOULDBLOCK
+#define WSAEINTR        EINTR
+#define SD_BOTH         SHUT_RDWR
+#define MAKEWORD(a, b)  ((unsigned short)(((a) & 0xff) | (((b) & 0xff) << 8)))
+
+struct WSADATA {
+    unsigned short wVersion;
+};
+
+inline int WSAStartup(unsigned short version, WSADATA* data) {
+    data->wVersion = version;
+    return 0;
+}
+
+inline int WSACleanup() { return 0; }
+
+inline int WSAGetLastError() { return errno; }
+
+inline int closesocket(SOCKET s) { return close(s); }
+
+// Same argument order as the MSVC runtime version
+inline int localtime_s(struct tm* result, const time_t* timer) {
+    return localtime_r(timer, result) ? 0 : errno;
+}
+
+inline bool setSocketNonBlocking(SOCKET s, bool enabled = true) {
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags == -1) {
+        return false;
+    }
+    flags = enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(s, F_SETFL, flags) == 0;
+}
+
+inline bool setSocketReceiveTimeout(SOCKET s, unsigned milliseconds) {
+    struct timeval timeout;
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_usec = (milliseconds % 1000) * 1000;
+    return setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0;
+}
+
+// Let the kernel probe a connection that has been silent for `idleSeconds`
+inline bool enableTcpKeepalive(SOCKET s, unsigned idleSeconds) {
+    int enable = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) != 0) {
+        return false;
+    }
+#ifdef TCP_KEEPIDLE
+    int idle = (int)idleSeconds;
+    int interval = 5;
+    int probes = 3;
+    setsockopt(s, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(s, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(s, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+#else
+    (void)idleSeconds;
+#endif
+    return true;
+}
+
+// Lift the soft descriptor limit to the hard limit so one process can hold
+// tens of thousands of sockets
+inline void raiseFileDescriptorLimit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
 #endif // _WIN32
 
+// Send small writes at once instead of waiting to fill a segment; callers
+// that want bigger writes coalesce output themselves
+inline bool setTcpNoDelay(SOCKET s, bool enabled = true) {
+    int value = enabled ? 1 : 0;
+    return setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&value, sizeof(value)) == 0;
+}
+
+// One buffer of a gather write
+struct IoSlice {
+    const char* data;
+    size_t length;
+};
+
+const size_t MAX_IO_SLICES = 64;
+
+// Write up to MAX_IO_SLICES buffers with a single system call. Returns the
+// number of bytes sent or SOCKET_ERROR. `more` says another write follows
+// at once: on Linux the kernel then holds back a partial segment (MSG_MORE,
+// a one-call TCP_CORK) so the two writes go out as full segments.
+inline int sendBuffers(SOCKET s, const IoSlice* slices, size_t count, bool more = false) {
+    if (count > MAX_IO_SLICES) {
+        count = MAX_IO_SLICES;
+    }
+#ifdef _WIN32
+    WSABUF buffers[MAX_IO_SLICES];
+    for (size_t i = 0; i < count; ++i) {
+        buffers[i].buf = const_cast<CHAR*>(slices[i].data);
+        buffers[i].len = (ULONG)slices[i].length;
+    }
+    (void)more;
+    DWORD sent = 0;
+    if (WSASend(s, buffers, (DWORD)count, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+    return (int)sent;
+#else
+    struct iovec buffers[MAX_IO_SLICES];
+    for (size_t i = 0; i < count; ++i) {
+        buffers[i].iov_base = const_cast<char*>(slices[i].data);
+        buffers[i].iov_len = slices[i].length;
+    }
+    struct msghdr message{};
+    message.msg_iov = buffers;
+    message.msg_iovlen = count;
+    int flags = MSG_NOSIGNAL;
+#ifdef MSG_MORE
+    if (more) {
+        flags |= MSG_MORE;
+    }
+#else
+    (void)more;
+#endif
+    return (int)sendmsg(s, &message, flags);
+#endif
+}
+
+// True when a non-blocking call failed only because it would have blocked
+inline bool socketWouldBlock(int error) {
+#ifdef _WIN32
+    return error == WSAEWOULDBLOCK;
+#else
+    return error == EWOULDBLOCK || error == EAGAIN;
+#endif
+}
+
 #endif // WINDOWS_SOCKETS_H